@@ -0,0 +1,591 @@
+#include "RenderTools.h"
+#include "ImageWriter.h"
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define PATH_TRACING_HAS_SOCKETS
+#endif
+
+//==============================================================================
+//================================ Distributed =================================
+//==============================================================================
+// The coordinator splits every camera into the tiles of renderTiles and hands them to
+// worker processes over a stream socket; a worker traces a tile exactly as renderTiles
+// does and sends back its pixels, so the image is the same as a local render whichever
+// worker traced which tile. Messages are a type and a payload size followed by the
+// payload, in the byte order of the machines, which must match along with the precision.
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint32_t protocolVersion = 1;
+constexpr uint32_t maxMessageSize = 1 << 24;
+constexpr int connectAttempts = 50;             // 100 ms apart, workers may start before the coordinator
+constexpr int pollInterval = 100;               // ms between checks for late tiles
+constexpr int tilesPerThread = 2;               // in flight per worker thread, so workers never wait
+
+enum MessageType : uint32_t {
+    helloMessage = 1,       // worker -> coordinator: HelloMessage
+    rejectMessage,          // coordinator -> worker: the scenes differ
+    tileMessage,            // coordinator -> worker: TileMessage
+    resultMessage,          // worker -> coordinator: TileMessage and the tile's pixels, row by row
+    doneMessage             // coordinator -> worker: the render is complete
+};
+
+struct MessageHeader {
+    uint32_t type = 0;
+    uint32_t size = 0;
+};
+
+struct HelloMessage {
+    uint32_t version = protocolVersion;
+    uint32_t threads = 1;
+    uint64_t fingerprint = 0;
+};
+
+struct TileMessage {
+    int32_t task = 0;
+    int32_t camera = 0;
+    int32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+};
+
+// 64-bit FNV-1a, as hashFiles
+class Fingerprint {
+public:
+    void add(const void *data, size_t size) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    template<typename T>
+    void add(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "hashed as raw bytes");
+        add(&value, sizeof(T));
+    }
+
+    void add(const Vec3r &value) {
+        add(value.val, sizeof(value.val));
+    }
+
+    uint64_t get() const { return hash; }
+
+private:
+    uint64_t hash = 14695981039346656037ull;
+};
+
+#ifdef PATH_TRACING_HAS_SOCKETS
+
+bool isUnixAddress(const std::string &address) {
+    return address.compare(0, 5, "unix:") == 0;
+}
+
+// "unix:<path>" or "<host>:<port>"; without a host a listener takes every interface and a
+// worker connects to localhost. Returns the socket or -1.
+int openSocket(const std::string &address, bool listener) {
+    if (isUnixAddress(address)) {
+        std::string path = address.substr(5);
+        sockaddr_un name = {};
+        if (path.empty() || path.size() >= sizeof(name.sun_path)) {
+            return -1;
+        }
+        name.sun_family = AF_UNIX;
+        std::memcpy(name.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listener) {
+            unlink(path.c_str());       // left over by a coordinator that did not exit cleanly
+            if (bind(fd, (sockaddr *) &name, sizeof(name)) == 0 && listen(fd, SOMAXCONN) == 0) {
+                return fd;
+            }
+        } else if (connect(fd, (sockaddr *) &name, sizeof(name)) == 0) {
+            return fd;
+        }
+        close(fd);
+        return -1;
+    }
+
+    size_t colon = address.find_last_of(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listener ? AI_PASSIVE : 0;
+    addrinfo *found = nullptr;
+    const char *node = host.empty() ? (listener ? nullptr : "localhost") : host.c_str();
+    if (getaddrinfo(node, port.c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo *info = found; info && fd < 0; info = info->ai_next) {
+        fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int on = 1;
+        bool opened;
+        if (listener) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            opened = bind(fd, info->ai_addr, info->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0;
+        } else {
+            opened = connect(fd, info->ai_addr, info->ai_addrlen) == 0;
+            // Tile requests are small and should not wait for more data
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        if (!opened) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+bool sendAll(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+#ifdef MSG_NOSIGNAL
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);       // a closed peer is an error, not SIGPIPE
+#else
+        ssize_t sent = send(fd, bytes, size, 0);
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+bool sendMessage(int fd, uint32_t type, const void *payload = nullptr, size_t size = 0,
+                 const void *extra = nullptr, size_t extra_size = 0) {
+    MessageHeader header;
+    header.type = type;
+    header.size = (uint32_t) (size + extra_size);
+    std::vector<char> bytes(sizeof(header) + header.size);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    if (size > 0) {
+        std::memcpy(bytes.data() + sizeof(header), payload, size);
+    }
+    if (extra_size > 0) {
+        std::memcpy(bytes.data() + sizeof(header) + size, extra, extra_size);
+    }
+    return sendAll(fd, bytes.data(), bytes.size());
+}
+
+bool isReadable(int fd) {
+    pollfd entry = {fd, POLLIN, 0};
+    return poll(&entry, 1, 0) > 0;
+}
+
+#endif
+
+}
+
+uint64_t Scene::getFingerprint() const {
+    Fingerprint fingerprint;
+    fingerprint.add((uint32_t) sizeof(Real));
+    fingerprint.add(triangles.size());
+    for (const auto &triangle : triangles) {
+        Vec3r v0, v1, v2;
+        triangle.getVertices(v0, v1, v2);
+        fingerprint.add(v0);
+        fingerprint.add(v1);
+        fingerprint.add(v2);
+        fingerprint.add(triangle.getMaterialId());
+    }
+    fingerprint.add(meshes.size());
+    for (const auto &mesh : meshes) {
+        fingerprint.add(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vec3r));
+        fingerprint.add(mesh.indices.data(), mesh.indices.size() * sizeof(int));
+    }
+    fingerprint.add(instances.size());
+    for (const auto &instance : instances) {
+        fingerprint.add(instance.mesh);
+        fingerprint.add(instance.materialId);
+        fingerprint.add(instance.objectToWorld.m);
+    }
+    fingerprint.add(materials.size());
+    for (const auto &material : materials) {
+        fingerprint.add(material.giveBRDF());
+        fingerprint.add(material.giveRGBCOlod());
+    }
+    fingerprint.add(lights.size());
+    for (const auto &light : lights) {
+        fingerprint.add(light.givePosition());
+        fingerprint.add(light.giveRGBIntensity());
+    }
+    for (const auto *spectra : {&materialSpectra, &lightSpectra}) {
+        fingerprint.add(spectra->size());
+        for (const auto &spectrum : *spectra) {
+            fingerprint.add(spectrum.getWavelengths().data(), spectrum.getWavelengths().size() * sizeof(Real));
+            fingerprint.add(spectrum.getValues().data(), spectrum.getValues().size() * sizeof(Real));
+        }
+    }
+    fingerprint.add(cameras.size());
+    for (const auto &camera : cameras) {
+        fingerprint.add(camera.getWidth());
+        fingerprint.add(camera.getHeight());
+        fingerprint.add(camera.getFov());
+        fingerprint.add(camera.getPosition());
+        fingerprint.add(camera.getAperture());
+        fingerprint.add(camera.getFocusDistance());
+    }
+    fingerprint.add(antialiasing);
+    fingerprint.add(lightInShadows);
+    fingerprint.add(bruteForce);
+    fingerprint.add(adaptiveSampling);
+    fingerprint.add(adaptiveThreshold);
+    fingerprint.add(maxSamples);
+    fingerprint.add(rayBudget);
+    fingerprint.add(maxDepth);
+    fingerprint.add(lightSamples);
+    fingerprint.add(samplerType);
+    fingerprint.add(spectral);
+    fingerprint.add(spectralLanes);
+    return fingerprint.get();
+}
+
+int Scene::renderDistributed(const std::string &address) {
+#ifndef PATH_TRACING_HAS_SOCKETS
+    std::cout << "Coordinator: sockets are not supported on this platform" << std::endl;
+    return 1;
+#else
+    struct Task {
+        TileMessage tile;
+        bool done = false;
+        Clock::time_point sent;
+    };
+
+    struct Connection {
+        int fd = -1;
+        bool ready = false;         // the hello was accepted
+        int threads = 1;
+        std::vector<char> input;
+        std::vector<int> tasks;     // sent and not answered yet
+    };
+
+    build();
+    relightPaths.clear();
+
+    std::vector<Task> tasks;
+    for (int c = 0; c < cameras.size(); c++) {
+        int width = cameras[c].getWidth();
+        int height = cameras[c].getHeight();
+        for (int y0 = 0; y0 < height; y0 += tileSize) {
+            for (int x0 = 0; x0 < width; x0 += tileSize) {
+                Task task;
+                task.tile.task = (int32_t) tasks.size();
+                task.tile.camera = c;
+                task.tile.x0 = x0;
+                task.tile.y0 = y0;
+                task.tile.x1 = std::min(x0 + tileSize, width);
+                task.tile.y1 = std::min(y0 + tileSize, height);
+                tasks.push_back(task);
+            }
+        }
+    }
+
+    int listener = openSocket(address, true);
+    if (listener < 0) {
+        std::cout << "Coordinator: failed to listen on " << address << std::endl;
+        return 1;
+    }
+    std::vector<std::unique_ptr<ImageWriter>> writers(cameras.size());
+    for (int c = 0; c < cameras.size(); c++) {
+        writers[c] = createWriter(c, -1);
+    }
+    std::cout << "Coordinator: " << tasks.size() << " tiles on " << address << std::endl;
+
+    uint64_t fingerprint = getFingerprint();
+    std::deque<int> pending;
+    for (int i = 0; i < tasks.size(); i++) {
+        pending.push_back(i);
+    }
+    int remaining = (int) tasks.size();
+    std::vector<Connection> connections;
+    std::vector<Vec3r> pixels;
+
+    // Unanswered tiles go back to the front of the queue, to be traced next
+    auto drop = [&](Connection &connection) {
+        for (auto it = connection.tasks.rbegin(); it != connection.tasks.rend(); ++it) {
+            if (!tasks[*it].done) {
+                pending.push_front(*it);
+            }
+        }
+        close(connection.fd);
+        connection.fd = -1;
+        connection.tasks.clear();
+    };
+
+    // Returns false for a message that breaks the protocol
+    auto handle = [&](Connection &connection, const MessageHeader &header, const char *payload) {
+        if (header.type == helloMessage) {
+            HelloMessage hello;
+            if (connection.ready || header.size != sizeof(hello)) {
+                return false;
+            }
+            std::memcpy(&hello, payload, sizeof(hello));
+            if (hello.version != protocolVersion || hello.fingerprint != fingerprint) {
+                std::cout << "Coordinator: rejected a worker with another scene or version" << std::endl;
+                sendMessage(connection.fd, rejectMessage);
+                return false;
+            }
+            connection.ready = true;
+            connection.threads = std::max(1u, hello.threads);
+            return true;
+        }
+        if (header.type != resultMessage || !connection.ready || header.size < sizeof(TileMessage)) {
+            return false;
+        }
+
+        TileMessage tile;
+        std::memcpy(&tile, payload, sizeof(tile));
+        auto assigned = std::find(connection.tasks.begin(), connection.tasks.end(), tile.task);
+        if (assigned == connection.tasks.end()) {
+            return false;
+        }
+        Task &task = tasks[tile.task];
+        size_t count = (size_t) (task.tile.x1 - task.tile.x0) * (task.tile.y1 - task.tile.y0);
+        if (header.size != sizeof(tile) + count * sizeof(Vec3r)) {
+            return false;
+        }
+        connection.tasks.erase(assigned);
+
+        // A tile handed out twice is kept from the first answer; both answers are the same
+        if (!task.done) {
+            pixels.resize(count);
+            std::memcpy((void *) pixels.data(), payload + sizeof(tile), count * sizeof(Vec3r));
+            if (ImageWriter *writer = writers[task.tile.camera].get()) {
+                STATS_TIMER(Write);
+                writer->writeTile(pixels.data(), task.tile.x1 - task.tile.x0, task.tile.x0, task.tile.y0,
+                                  task.tile.x1, task.tile.y1);
+            }
+            task.done = true;
+            remaining--;
+        }
+        return true;
+    };
+
+    auto assign = [&](Connection &connection, int index) {
+        if (!sendMessage(connection.fd, tileMessage, &tasks[index].tile, sizeof(TileMessage))) {
+            drop(connection);
+            return false;
+        }
+        connection.tasks.push_back(index);
+        tasks[index].sent = Clock::now();
+        return true;
+    };
+
+    std::vector<pollfd> entries;
+    std::vector<char> buffer(1 << 16);
+    STATS_TIMER(Render);
+    while (remaining > 0) {
+        entries.assign(1, {listener, POLLIN, 0});
+        for (const auto &connection : connections) {
+            entries.push_back({connection.fd, POLLIN, 0});
+        }
+        if (poll(entries.data(), entries.size(), pollInterval) < 0) {
+            continue;
+        }
+
+        for (size_t k = 1; k < entries.size(); k++) {
+            Connection &connection = connections[k - 1];
+            if (!(entries[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t received = recv(connection.fd, buffer.data(), buffer.size(), 0);
+            if (received <= 0) {
+                drop(connection);
+                continue;
+            }
+            connection.input.insert(connection.input.end(), buffer.data(), buffer.data() + received);
+
+            size_t offset = 0;
+            MessageHeader header;
+            while (connection.fd >= 0 && connection.input.size() - offset >= sizeof(header)) {
+                std::memcpy(&header, connection.input.data() + offset, sizeof(header));
+                if (header.size > maxMessageSize) {
+                    drop(connection);
+                    break;
+                }
+                if (connection.input.size() - offset < sizeof(header) + header.size) {
+                    break;
+                }
+                if (!handle(connection, header, connection.input.data() + offset + sizeof(header))) {
+                    drop(connection);
+                    break;
+                }
+                offset += sizeof(header) + header.size;
+            }
+            connection.input.erase(connection.input.begin(), connection.input.begin() + offset);
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [](const Connection &connection) { return connection.fd < 0; }),
+                          connections.end());
+
+        if (entries[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                Connection connection;
+                connection.fd = fd;
+                connections.push_back(std::move(connection));
+            }
+        }
+
+        // Queued tiles first; once the queue is empty a tile that has been out for tileTimeout
+        // seconds, with a slow or hung worker, is handed to a worker that has nothing to do
+        for (auto &connection : connections) {
+            while (connection.ready && connection.fd >= 0 && !pending.empty() &&
+                   connection.tasks.size() < tilesPerThread * connection.threads) {
+                int index = pending.front();
+                pending.pop_front();
+                if (!tasks[index].done) {
+                    assign(connection, index);
+                }
+            }
+            if (!connection.ready || connection.fd < 0 || !pending.empty() || !connection.tasks.empty()) {
+                continue;
+            }
+            int late = -1;
+            for (int i = 0; i < tasks.size(); i++) {
+                double age = std::chrono::duration<double>(Clock::now() - tasks[i].sent).count();
+                if (!tasks[i].done && age >= tileTimeout && (late < 0 || tasks[i].sent < tasks[late].sent)) {
+                    late = i;
+                }
+            }
+            if (late >= 0) {
+                assign(connection, late);
+            }
+        }
+    }
+
+    for (auto &connection : connections) {
+        if (connection.fd >= 0) {
+            sendMessage(connection.fd, doneMessage);
+            close(connection.fd);
+        }
+    }
+    close(listener);
+    if (isUnixAddress(address)) {
+        unlink(address.substr(5).c_str());
+    }
+    for (int c = 0; c < cameras.size(); c++) {
+        closeWriter(getImagePath(c, -1), writers[c].get());
+    }
+    writeStats();
+    return 0;
+#endif
+}
+
+int Scene::runWorker(const std::string &address) {
+#ifndef PATH_TRACING_HAS_SOCKETS
+    std::cout << "Worker: sockets are not supported on this platform" << std::endl;
+    return 1;
+#else
+    build();
+    getPool();
+
+    int fd = -1;
+    for (int attempt = 0; attempt < connectAttempts && fd < 0; attempt++) {
+        fd = openSocket(address, false);
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (fd < 0) {
+        std::cout << "Worker: failed to connect to " << address << std::endl;
+        return 1;
+    }
+
+    HelloMessage hello;
+    hello.threads = (uint32_t) pool->getThreadsCount();
+    hello.fingerprint = getFingerprint();
+    int exit_code = sendMessage(fd, helloMessage, &hello, sizeof(hello)) ? 0 : 2;
+
+    std::atomic<long long> budget(rayBudget);       // per worker, the coordinator does not split it
+    std::vector<TileMessage> batch;
+    std::vector<std::vector<Vec3r>> results;
+    std::vector<std::vector<Vec3r>> samples(pool->getThreadsCount());
+    std::vector<std::vector<Vec3r>> pixels(pool->getThreadsCount());
+    bool done = false;
+    while (exit_code == 0 && !done) {
+        // Every tile already received is traced in one parallel batch
+        batch.clear();
+        do {
+            MessageHeader header;
+            TileMessage tile;
+            if (!receiveAll(fd, &header, sizeof(header))) {
+                exit_code = 2;
+            } else if (header.type == doneMessage && header.size == 0) {
+                done = true;
+            } else if (header.type == rejectMessage) {
+                std::cout << "Worker: the coordinator renders another scene" << std::endl;
+                exit_code = 2;
+            } else if (header.type != tileMessage || header.size != sizeof(tile) ||
+                       !receiveAll(fd, &tile, sizeof(tile)) || tile.camera < 0 || tile.camera >= cameras.size()) {
+                exit_code = 2;
+            } else if (tile.x0 < 0 || tile.x0 >= tile.x1 || tile.x1 > cameras[tile.camera].getWidth() ||
+                       tile.y0 < 0 || tile.y0 >= tile.y1 || tile.y1 > cameras[tile.camera].getHeight()) {
+                // An empty, inverted or outside rectangle would wrap the pixel count
+                exit_code = 2;
+            } else {
+                batch.push_back(tile);
+            }
+        } while (exit_code == 0 && !done && isReadable(fd));
+
+        results.resize(batch.size());
+        pool->parallelFor((int) batch.size(), [&](int k, int worker) {
+            const TileMessage &tile = batch[k];
+            const Vec3r *tile_pixels = traceTile(cameras[tile.camera], tile.x0, tile.y0, tile.x1, tile.y1,
+                                                 samples[worker], pixels[worker], budget);
+            results[k].assign(tile_pixels, tile_pixels + (size_t) (tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+        });
+        for (size_t k = 0; k < batch.size() && exit_code == 0; k++) {
+            if (!sendMessage(fd, resultMessage, &batch[k], sizeof(TileMessage), results[k].data(),
+                             results[k].size() * sizeof(Vec3r))) {
+                exit_code = 2;
+            }
+        }
+    }
+    close(fd);
+    writeStats();
+    return exit_code;
+#endif
+}
@@ -0,0 +1,320 @@
+#include "ImageWriter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+//==============================================================================
+//================================ ImageWriter =================================
+//==============================================================================
+bool ImageWriter::open(const std::string &path_to_file, const std::string &header) {
+    file.open(path_to_file, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write(header.data(), (std::streamsize) header.size());
+    return file.good();
+}
+
+void ImageWriter::writeTile(const Vec3r *pixels, size_t stride, int x0, int y0, int x1, int y1) {
+    // Encoding happens outside the lock, only the file writes are serialized
+    std::vector<std::vector<char>> rows(y1 - y0);
+    for (int y = y0; y < y1; y++) {
+        encodeRow(pixels + (y - y0) * stride, x1 - x0, rows[y - y0]);
+    }
+
+    int pieces = piecesPerRow();
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int y = y0; y < y1; y++) {
+        const std::vector<char> &bytes = rows[y - y0];
+        size_t piece_size = bytes.size() / pieces;
+        for (int piece = 0; piece < pieces; piece++) {
+            file.seekp(rowOffset(x0, y, piece));
+            file.write(bytes.data() + piece * piece_size, (std::streamsize) piece_size);
+        }
+    }
+}
+
+int ImageWriter::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!file.is_open()) {
+        return 1;
+    }
+    bool good = file.good();
+    file.close();
+    return good ? 0 : 2;
+}
+
+namespace {
+
+void appendFloat(std::vector<char> &bytes, float value, bool big_endian) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 4; i++) {
+        int shift = big_endian ? 24 - 8 * i : 8 * i;
+        bytes.push_back((char) ((bits >> shift) & 0xff));
+    }
+}
+
+//==============================================================================
+//================================ PFM =========================================
+//==============================================================================
+class PfmWriter : public ImageWriter {
+public:
+    PfmWriter(int width, int height) : ImageWriter(width, height) {}
+
+    bool open(const std::string &path_to_file) {
+        // A negative scale marks little-endian data
+        header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+        return ImageWriter::open(path_to_file, header);
+    }
+
+protected:
+    void encodeRow(const Vec3r *pixels, int count, std::vector<char> &bytes) const override {
+        bytes.reserve(12 * count);
+        for (int x = 0; x < count; x++) {
+            for (int k = 0; k < 3; k++) {
+                appendFloat(bytes, (float) pixels[x][k], false);
+            }
+        }
+    }
+
+    // Rows are stored bottom to top
+    long long rowOffset(int x, int y, int) const override {
+        return (long long) header.size() + ((long long) (height - 1 - y) * width + x) * 12;
+    }
+
+private:
+    std::string header;
+};
+
+//==============================================================================
+//================================ Radiance HDR ================================
+//==============================================================================
+class HdrWriter : public ImageWriter {
+public:
+    HdrWriter(int width, int height) : ImageWriter(width, height) {}
+
+    bool open(const std::string &path_to_file) {
+        header = "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " + std::to_string(height) +
+                 " +X " + std::to_string(width) + "\n";
+        return ImageWriter::open(path_to_file, header);
+    }
+
+protected:
+    // Flat scanlines keep a fixed 4 bytes per pixel. Readers cannot mistake them for
+    // run-length encoded ones: the largest mantissa of an RGBE pixel is at least 128.
+    void encodeRow(const Vec3r *pixels, int count, std::vector<char> &bytes) const override {
+        bytes.reserve(4 * count);
+        for (int x = 0; x < count; x++) {
+            double r = std::max(0.0, (double) pixels[x][0]);
+            double g = std::max(0.0, (double) pixels[x][1]);
+            double b = std::max(0.0, (double) pixels[x][2]);
+            double brightest = std::max({r, g, b});
+            if (brightest < 1e-32) {
+                bytes.insert(bytes.end(), 4, 0);
+                continue;
+            }
+            int exponent;
+            double scale = std::frexp(brightest, &exponent) * 256.0 / brightest;
+            bytes.push_back((char) (unsigned char) (r * scale));
+            bytes.push_back((char) (unsigned char) (g * scale));
+            bytes.push_back((char) (unsigned char) (b * scale));
+            bytes.push_back((char) (unsigned char) (exponent + 128));
+        }
+    }
+
+    long long rowOffset(int x, int y, int) const override {
+        return (long long) header.size() + ((long long) y * width + x) * 4;
+    }
+
+private:
+    std::string header;
+};
+
+//==============================================================================
+//================================ NIT =========================================
+//==============================================================================
+// 1024-byte header, then for every row its red, green and blue planes as big-endian
+// floats, then tagged records. A record is 0x01, the key length, the value length as a
+// big-endian 16-bit number, the key and the zero-terminated value. Header fields are
+// written exactly as the post-processor writes them; at 0x14 are the width and height
+// in hex, four characters each (" 200 200" for 512x512).
+class NitWriter : public ImageWriter {
+public:
+    NitWriter(int width, int height) : ImageWriter(width, height) {}
+
+    bool open(const std::string &path_to_file) {
+        std::string header(headerSize, '\0');
+        auto put = [&](size_t offset, const std::string &text) {
+            std::copy(text.begin(), text.end(), header.begin() + offset);
+        };
+        put(0x00, std::string("\xff\xff\xff\xff\x01\x03\x00\x01", 8));
+        char size[16];
+        std::snprintf(size, sizeof(size), "%4x%4x", width, height);
+        put(0x14, size);
+        put(0x1c, "lum red,lum gre,lum blu");
+        put(0x8e, "   ");
+        std::string name = path_to_file.substr(path_to_file.find_last_of("/\\") + 1);
+        put(0x100, name.substr(0, 0xff));
+
+        static const char version[] = "IIF_SystVer=NT\0IIF_FloatVer=0\0IIF_NewVer=1\0IIF_Types=fff\0";
+        std::string records(version, sizeof(version));
+        records += record("FILE_TYPE=", "LUMINANCE");
+        records += record("image pixel step=", "1 1");
+        records += record("step size [m]=", "1.0000000 1.0000000");
+        records += record("pixel type=", "PIXEL");
+        records += record("pix_type_Y=", "PIXEL");
+        records += record("exposure=", "1.000000");
+        records += record("gamma=", "1.000000");
+        records += '\x10';
+        put(0x200, records);
+        put(0x300, "   1");
+        return ImageWriter::open(path_to_file, header);
+    }
+
+    int close() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::string records;
+            records += record("primaries=", "0.622000 0.330000 0.283000 0.619000 0.144000 0.070000 0.312750 0.329059");
+            records += record("alias_level=", "0");
+            records += record("RAY_NUMBER=", "0");
+            records += record("TOTAL_RAD_FLUX=", "0.000000");
+            records += record("TOTAL_LUM_FLUX=", "0.000000");
+            records += record("AVERAGE_CHROMATICITY=", "0.000000 0.000000");
+            records += record("PROJ_TYPE=", "3");
+            records += record("CAMERA_CENTER=", "0.000000 0.000000");
+            records += record("PROJ_STEP_SIZE=", "0.000000 0.000000");
+            records += record("CAM_POS=", "0.000000 0.000000 0.000000");
+            records += record("CAM_VIEW_ANGLE=", "0.000000");
+            records += record("CAM_COV_AREA=", "0.000000 0.000000");
+            records += '\x03';
+            file.seekp(rowOffset(0, height, 0));
+            file.write(records.data(), (std::streamsize) records.size());
+        }
+        return ImageWriter::close();
+    }
+
+protected:
+    void encodeRow(const Vec3r *pixels, int count, std::vector<char> &bytes) const override {
+        bytes.reserve(12 * count);
+        for (int k = 0; k < 3; k++) {
+            for (int x = 0; x < count; x++) {
+                appendFloat(bytes, (float) pixels[x][k], true);
+            }
+        }
+    }
+
+    long long rowOffset(int x, int y, int piece) const override {
+        return headerSize + (((long long) y * 3 + piece) * width + x) * 4;
+    }
+
+    int piecesPerRow() const override { return 3; }
+
+private:
+    static std::string record(const std::string &key, const std::string &value) {
+        std::string result;
+        result += '\x01';
+        result += (char) key.size();
+        result += (char) ((value.size() + 1) >> 8);
+        result += (char) ((value.size() + 1) & 0xff);
+        result += key;
+        result += value;
+        result += '\0';
+        return result;
+    }
+
+private:
+    static constexpr long long headerSize = 0x400;
+};
+
+//==============================================================================
+//================================ Text ========================================
+//==============================================================================
+// The "wavelength r/g/b" tables that render() used to write, kept for scriptRGB.py
+class TextWriter : public ImageWriter {
+public:
+    TextWriter(int width, int height) : ImageWriter(width, height), pixels((size_t) width * height) {}
+
+    bool open(const std::string &path_to_file) {
+        file.open(path_to_file, std::ios::out | std::ios::trunc);
+        return file.is_open();
+    }
+
+    void writeTile(const Vec3r *tile, size_t stride, int x0, int y0, int x1, int y1) override {
+        for (int y = y0; y < y1; y++) {
+            std::copy(tile + (y - y0) * stride, tile + (y - y0) * stride + (x1 - x0), &pixels[x0 + (size_t) y * width]);
+        }
+    }
+
+    int close() override {
+        std::vector<std::string> wavelengths;
+        wavelengths.emplace_back("r");
+        wavelengths.emplace_back("g");
+        wavelengths.emplace_back("b");
+
+        for (int k = 0; k < wavelengths.size(); k++) {
+            file << "wavelength" << " " << wavelengths[k] << std::endl;
+            for (long long i = 0; i < height; i++) {
+                for (long long j = 0; j < width; j++) {
+                    if (j == 0) {
+                        file << pixels[j + i * width][k];
+                    } else {
+                        file << " "
+                             << pixels[j + i * width][k];
+                    }
+                }
+                file << std::endl;
+            }
+            file << "\n";
+        }
+        return ImageWriter::close();
+    }
+
+protected:
+    void encodeRow(const Vec3r *, int, std::vector<char> &) const override {}
+    long long rowOffset(int, int, int) const override { return 0; }
+
+private:
+    std::vector<Vec3r> pixels;
+};
+
+std::string getExtension(const std::string &path_to_file) {
+    size_t dot = path_to_file.find_last_of('.');
+    if (dot == std::string::npos || path_to_file.find_first_of("/\\", dot) != std::string::npos) {
+        return std::string();
+    }
+    std::string extension = path_to_file.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return (char) std::tolower(c); });
+    return extension;
+}
+
+template<typename Writer>
+std::unique_ptr<ImageWriter> makeWriter(const std::string &path_to_file, int width, int height) {
+    auto writer = std::make_unique<Writer>(width, height);
+    if (!writer->open(path_to_file)) {
+        return nullptr;
+    }
+    return writer;
+}
+
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::create(const std::string &path_to_file, int width, int height) {
+    std::string extension = getExtension(path_to_file);
+    if (extension == "pfm") {
+        return makeWriter<PfmWriter>(path_to_file, width, height);
+    }
+    if (extension == "hdr") {
+        return makeWriter<HdrWriter>(path_to_file, width, height);
+    }
+    if (extension == "nit") {
+        return makeWriter<NitWriter>(path_to_file, width, height);
+    }
+    return makeWriter<TextWriter>(path_to_file, width, height);
+}
@@ -0,0 +1,54 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "Precision.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//==============================================================================
+//================================ ImageWriter =================================
+//==============================================================================
+// Writes the radiance of a rendered image while it is being rendered. The format
+// follows the extension of the path:
+//   .pfm  - Portable Float Map, little-endian RGB floats
+//   .hdr  - Radiance RGBE with flat (not run-length encoded) scanlines
+//   .nit  - the post-processor luminance layout (data/results_converted_RGB.nit)
+//   other - the text tables read by data/scriptRGB.py
+// Binary formats have fixed-size pixels, so every tile goes straight to its place in
+// the file; the text format needs the whole image and is kept in memory until close().
+class ImageWriter {
+public:
+    virtual ~ImageWriter() = default;
+
+    // Returns nullptr if the file cannot be created
+    static std::unique_ptr<ImageWriter> create(const std::string &path_to_file, int width, int height);
+
+    // Stores the rectangle [x0, x1) x [y0, y1) of the image; pixels holds its rows one after
+    // another, stride apart. Safe to call from several threads at once with disjoint rectangles.
+    virtual void writeTile(const Vec3r *pixels, size_t stride, int x0, int y0, int x1, int y1);
+    // Returns 0 if everything reached the file
+    virtual int close();
+
+protected:
+    ImageWriter(int width, int height) : width(width), height(height) {}
+
+    // Creates the file and writes the header
+    bool open(const std::string &path_to_file, const std::string &header);
+    // Converts one row of a tile to the bytes of the file
+    virtual void encodeRow(const Vec3r *pixels, int count, std::vector<char> &bytes) const = 0;
+    // Byte offsets of the pieces of a tile row; most formats write one piece per row
+    virtual long long rowOffset(int x, int y, int piece) const = 0;
+    virtual int piecesPerRow() const { return 1; }
+
+protected:
+    const int width;
+    const int height;
+    std::fstream file;
+    std::mutex mutex;
+};
+
+#endif //IMAGE_WRITER_H
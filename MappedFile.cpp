@@ -0,0 +1,74 @@
+#include "MappedFile.h"
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PATH_TRACING_HAS_MMAP
+#endif
+
+//==============================================================================
+//================================ MappedFile ==================================
+//==============================================================================
+MappedFile::~MappedFile() {
+    close();
+}
+
+int MappedFile::open(const std::string &path_to_file) {
+    close();
+
+#ifdef PATH_TRACING_HAS_MMAP
+    int fd = ::open(path_to_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return 2;
+    }
+    length = (size_t) info.st_size;
+    if (length > 0) {
+        void *address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            length = 0;
+            return 3;
+        }
+        madvise(address, length, MADV_SEQUENTIAL);
+        begin = static_cast<const char *>(address);
+        mapped = true;
+    }
+    ::close(fd);
+    return 0;
+#else
+    std::ifstream file(path_to_file, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return 1;
+    }
+    buffer.resize((size_t) file.tellg());
+    file.seekg(0);
+    if (!file.read(buffer.data(), (std::streamsize) buffer.size())) {
+        buffer.clear();
+        return 2;
+    }
+    begin = buffer.data();
+    length = buffer.size();
+    return 0;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef PATH_TRACING_HAS_MMAP
+    if (mapped) {
+        munmap(const_cast<char *>(begin), length);
+    }
+#endif
+    begin = nullptr;
+    length = 0;
+    mapped = false;
+    buffer.clear();
+}
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//==============================================================================
+//================================ MappedFile ==================================
+//==============================================================================
+// Read-only view of a whole file. The file is mapped into memory where the
+// platform allows it and read into a buffer otherwise.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    int open(const std::string &path_to_file);     // 0 on success
+    void close();
+
+    const char *data() const { return begin; }
+    size_t size() const { return length; }
+
+private:
+    const char *begin = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<char> buffer;
+};
+
+#endif //MAPPED_FILE_H
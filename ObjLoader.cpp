@@ -0,0 +1,181 @@
+#include "ObjLoader.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <charconv>
+
+//==============================================================================
+//================================ ObjLoader ===================================
+//==============================================================================
+namespace {
+
+// Files below this size are parsed on the calling thread
+constexpr size_t minParallelSize = 1 << 20;
+constexpr size_t minChunkSize = 256 << 10;
+
+struct ObjChunk {
+    std::vector<Vec3r> vertices;
+    std::vector<int> indices;
+    // Positions in indices holding negative OBJ indices, stored relative to the
+    // first vertex of the chunk until the chunk offsets are known
+    std::vector<size_t> relative;
+    int error = 0;
+};
+
+bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char *skipBlanks(const char *p, const char *end) {
+    while (p < end && isBlank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+bool parseReal(const char *&p, const char *end, double &value) {
+    p = skipBlanks(p, end);
+    if (p < end && *p == '+') {
+        p++;
+    }
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
+
+bool parseIndex(const char *&p, const char *end, int &value) {
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc() || value == 0) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
+
+void parseChunk(const char *p, const char *end, ObjChunk &chunk) {
+    std::vector<int> polygon;
+    std::vector<char> polygon_relative;
+
+    while (p < end && chunk.error == 0) {
+        const char *line_end = std::find(p, end, '\n');
+        p = skipBlanks(p, line_end);
+
+        if (line_end - p > 1 && p[0] == 'v' && isBlank(p[1])) {
+            double cords[3];
+            p += 1;
+            for (double &cord : cords) {
+                if (!parseReal(p, line_end, cord)) {
+                    chunk.error = 2;
+                }
+            }
+            chunk.vertices.emplace_back(cords[0], cords[1], cords[2]);
+        } else if (line_end - p > 1 && p[0] == 'f' && isBlank(p[1])) {
+            polygon.clear();
+            polygon_relative.clear();
+            p = skipBlanks(p + 1, line_end);
+            while (p < line_end) {
+                int index;
+                if (!parseIndex(p, line_end, index)) {
+                    chunk.error = 2;
+                    break;
+                }
+                // Texture and normal indices are accepted and skipped
+                while (p < line_end && !isBlank(*p)) {
+                    p++;
+                }
+                if (index > 0) {
+                    polygon.push_back(index - 1);
+                    polygon_relative.push_back(0);
+                } else {
+                    polygon.push_back((int) chunk.vertices.size() + index);
+                    polygon_relative.push_back(1);
+                }
+                p = skipBlanks(p, line_end);
+            }
+            if (polygon.size() < 3) {
+                chunk.error = 2;
+            }
+            for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                for (size_t corner : {(size_t) 0, k, k + 1}) {
+                    if (polygon_relative[corner]) {
+                        chunk.relative.push_back(chunk.indices.size());
+                    }
+                    chunk.indices.push_back(polygon[corner]);
+                }
+            }
+        }
+        // Comments, groups, materials, texture coordinates and normals are not used
+
+        p = line_end + 1;
+    }
+}
+
+}
+
+int loadObj(const std::string &path_to_file, ObjMesh &mesh, ThreadPool *pool) {
+    MappedFile file;
+    if (file.open(path_to_file) != 0) {
+        return 1;
+    }
+    const char *data = file.data();
+    size_t size = file.size();
+
+    // Chunks end right after a newline, so no line is split between two of them
+    std::vector<size_t> bounds = {0};
+    if (pool && size >= minParallelSize) {
+        size_t chunks_count = std::min<size_t>(size / minChunkSize, 4 * (size_t) pool->getThreadsCount());
+        for (size_t k = 1; k < chunks_count; k++) {
+            size_t position = std::max(bounds.back(), size * k / chunks_count);
+            const char *line_end = std::find(data + position, data + size, '\n');
+            if (line_end == data + size) {
+                break;
+            }
+            bounds.push_back(line_end - data + 1);
+        }
+    }
+    bounds.push_back(size);
+
+    std::vector<ObjChunk> chunks(bounds.size() - 1);
+    auto parse = [&](int k, int) {
+        parseChunk(data + bounds[k], data + bounds[k + 1], chunks[k]);
+    };
+    if (chunks.size() > 1) {
+        pool->parallelFor((int) chunks.size(), parse);
+    } else {
+        parse(0, 0);
+    }
+
+    size_t vertices_count = 0;
+    size_t indices_count = 0;
+    for (const auto &chunk : chunks) {
+        if (chunk.error != 0) {
+            return chunk.error;
+        }
+        vertices_count += chunk.vertices.size();
+        indices_count += chunk.indices.size();
+    }
+
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    mesh.vertices.reserve(vertices_count);
+    mesh.indices.reserve(indices_count);
+    for (auto &chunk : chunks) {
+        int offset = (int) mesh.vertices.size();
+        for (size_t position : chunk.relative) {
+            chunk.indices[position] += offset;
+        }
+        mesh.vertices.insert(mesh.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+    }
+
+    for (int index : mesh.indices) {
+        if (index < 0 || index >= (int) mesh.vertices.size()) {
+            return 3;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "Precision.h"
+
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+//==============================================================================
+//================================ ObjLoader ===================================
+//==============================================================================
+// Indexed triangle mesh read from a Wavefront OBJ file. Faces may use the v, v/vt,
+// v//vn and v/vt/vn forms and negative (relative) indices; polygons with more than
+// three vertices are split into a fan. Only positions are kept, the renderer shades
+// with face normals.
+struct ObjMesh {
+    std::vector<Vec3r> vertices;
+    std::vector<int> indices;       // three per triangle
+};
+
+// Returns 0 on success, 1 if the file cannot be read, 2 on a malformed line and
+// 3 on a face index outside the vertex list. With a pool, large files are split at
+// line boundaries and the pieces are parsed in parallel.
+int loadObj(const std::string &path_to_file, ObjMesh &mesh, ThreadPool *pool = nullptr);
+
+#endif //OBJ_LOADER_H
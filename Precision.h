@@ -0,0 +1,22 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include "VecMath.h"
+
+//==============================================================================
+//================================ Scalar type =================================
+//==============================================================================
+// Geometry and shading run in double by default, which is what the Lumicept
+// reference images are compared against. Configure with
+// -DPATH_TRACING_SINGLE_PRECISION=ON for the faster float build.
+#ifdef PATH_TRACING_SINGLE_PRECISION
+using Real = float;
+constexpr Real boundsPadding = 1e-5f;     // relative, about a hundred ulps
+#else
+using Real = double;
+constexpr Real boundsPadding = 1e-9;
+#endif
+
+using Vec3r = Vec<Real, 3>;
+
+#endif //PRECISION_H
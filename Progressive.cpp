@@ -0,0 +1,207 @@
+#include "RenderTools.h"
+#include "ImageWriter.h"
+#include "ThreadPool.h"
+
+#ifdef PATH_TRACING_HAS_OPENCV
+#include <opencv2/highgui.hpp>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+//==============================================================================
+//================================ Progressive =================================
+//==============================================================================
+// The image is refined pass after pass, every pass adding one sample to each pixel with
+// the pass as the sample index, so the Sobol points of a pixel stay stratified. A pass is
+// split into batches of tiles; between batches the running mean is shown in a highgui
+// window, in builds with OpenCV, and the stop conditions are checked, so a pass that is
+// cut short leaves some pixels with one sample less than the others.
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr double previewInterval = 0.25;       // seconds between window refreshes
+constexpr int batchTilesPerThread = 4;
+const char *const previewWindow = "path_tracing";
+
+struct Accumulator {
+    Vec3r sum = Vec3r(0, 0, 0);
+    Real luminance = 0;         // sums of the sample luminances and of their squares
+    Real luminance2 = 0;
+    int count = 0;
+};
+
+Real getLuminance(const Vec3r &L) {
+    return 0.2126 * L[0] + 0.7152 * L[1] + 0.0722 * L[2];
+}
+
+// Mean standard error of the pixels relative to the mean pixel luminance, over the pixels
+// with at least two samples; returns a negative value when there are none yet
+Real getRelativeError(const std::vector<Accumulator> &pixels) {
+    Real error = 0, luminance = 0;
+    for (const auto &pixel : pixels) {
+        if (pixel.count < 2) {
+            continue;
+        }
+        Real mean = pixel.luminance / pixel.count;
+        Real variance = std::max(Real(0), (pixel.luminance2 - mean * pixel.luminance) / (pixel.count - 1));
+        error += std::sqrt(variance / pixel.count);
+        luminance += mean;
+    }
+    return luminance > 0 ? error / luminance : -1;
+}
+
+#ifdef PATH_TRACING_HAS_OPENCV
+class Preview {
+public:
+    Preview() {
+        cv::namedWindow(previewWindow, cv::WINDOW_AUTOSIZE);
+    }
+
+    // Reinhard tone mapping with the exposure keyed to the mean luminance, then gamma 2.2.
+    // Returns true when Esc or q was pressed.
+    bool show(const std::vector<Accumulator> &pixels, int width, int height);
+
+private:
+    cv::Mat image;
+};
+
+bool Preview::show(const std::vector<Accumulator> &pixels, int width, int height) {
+    Real mean = 0;
+    int sampled = 0;
+    for (const auto &pixel : pixels) {
+        if (pixel.count > 0) {
+            mean += pixel.luminance / pixel.count;
+            sampled++;
+        }
+    }
+    Real exposure = sampled > 0 && mean > 0 ? 0.18 * sampled / mean : 1;
+
+    image.create(height, width, CV_8UC3);
+    for (int i = 0; i < height; i++) {
+        auto *row = image.ptr<cv::Vec3b>(i);
+        for (int j = 0; j < width; j++) {
+            const Accumulator &pixel = pixels[j + (size_t) i * width];
+            for (int c = 0; c < 3; c++) {
+                Real value = pixel.count > 0 ? exposure * pixel.sum[c] / pixel.count : 0;
+                value = std::pow(value / (1 + value), Real(1 / 2.2));
+                // OpenCV keeps the channels in BGR order
+                row[j][2 - c] = (unsigned char) std::min(255.0, 255.0 * value + 0.5);
+            }
+        }
+    }
+    cv::imshow(previewWindow, image);
+    int key = cv::waitKey(1);
+    return key == 27 || key == 'q';
+}
+#else
+// Without OpenCV there is no window: the render runs as with the preview off
+class Preview {
+public:
+    bool show(const std::vector<Accumulator> &, int, int) { return false; }
+};
+#endif
+
+}
+
+void Scene::renderProgressive(const Camera &camera, ImageWriter *writer) {
+    getPool();
+    int width = camera.getWidth();
+    int height = camera.getHeight();
+    int tiles_x = (width + tileSize - 1) / tileSize;
+    int tiles_y = (height + tileSize - 1) / tileSize;
+    int tiles_count = tiles_x * tiles_y;
+    int batch_size = pool->getThreadsCount() * batchTilesPerThread;
+
+    std::vector<Accumulator> pixels((size_t) width * height);
+    std::unique_ptr<Preview> window;
+    if (preview) {
+        window = std::make_unique<Preview>();
+    }
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point shown = start;
+    auto elapsed = [&](Clock::time_point since) {
+        return std::chrono::duration<double>(Clock::now() - since).count();
+    };
+
+    int passes = 0;
+    Real error = -1;
+    bool stop = false;
+    while (!stop && (maxPasses == 0 || passes < maxPasses)) {
+        int pass = passes;
+        for (int first = 0; first < tiles_count && !stop; first += batch_size) {
+            int batch_count = std::min(batch_size, tiles_count - first);
+            pool->parallelFor(batch_count, [&](int index, int) {
+                STATS_TIMER(Trace);
+                int tile = first + index;
+                int y0 = (tile / tiles_x) * tileSize;
+                int x0 = (tile % tiles_x) * tileSize;
+                int y1 = std::min(y0 + tileSize, height);
+                int x1 = std::min(x0 + tileSize, width);
+                STATS_ADD(cameraRays, (long long) (x1 - x0) * (y1 - y0));
+                for (long long i = y0; i < y1; i++) {
+                    for (long long j = x0; j < x1; j++) {
+                        long long pixel = j + i * width;
+                        Sampler sampler(samplerType, pixel, pass);
+                        Ray ray = camera.sampleRay(width, height, i, j, sampler, true);
+                        Vec3r L = fireRay(ray, sampler);
+                        Real luminance = getLuminance(L);
+                        Accumulator &accumulator = pixels[pixel];
+                        accumulator.sum += L;
+                        accumulator.luminance += luminance;
+                        accumulator.luminance2 += luminance * luminance;
+                        accumulator.count++;
+                    }
+                }
+            });
+
+            // Every pixel gets its first sample whatever the budget
+            if (pass > 0 && timeBudget > 0 && elapsed(start) >= timeBudget) {
+                stop = true;
+            }
+            if (window && (elapsed(shown) >= previewInterval || stop)) {
+                if (window->show(pixels, width, height)) {
+                    stop = true;
+                }
+                shown = Clock::now();
+            }
+        }
+        passes++;
+
+        error = getRelativeError(pixels);
+        if (convergenceTarget > 0 && error >= 0 && error <= convergenceTarget) {
+            stop = true;
+        }
+        if (timeBudget > 0 && elapsed(start) >= timeBudget) {
+            stop = true;
+        }
+    }
+
+    if (window) {
+        window->show(pixels, width, height);
+    }
+    if (progressReport) {
+        std::cout << "Progressive: " << passes << " passes in " << elapsed(start) << " s, relative error "
+                  << error << std::endl;
+    }
+
+    if (writer) {
+        // Written in bands of tile rows, so only one band of means is kept besides the sums
+        std::vector<Vec3r> band;
+        for (int y0 = 0; y0 < height; y0 += tileSize) {
+            int y1 = std::min(y0 + tileSize, height);
+            band.resize((size_t) width * (y1 - y0));
+            for (size_t k = 0; k < band.size(); k++) {
+                const Accumulator &pixel = pixels[(size_t) y0 * width + k];
+                // Esc during the first pass leaves pixels without samples
+                band[k] = pixel.count > 0 ? pixel.sum / pixel.count : Vec3r(0, 0, 0);
+            }
+            STATS_TIMER(Write);
+            writer->writeTile(band.data(), width, 0, y0, width, y1);
+        }
+    }
+}
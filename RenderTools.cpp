@@ -1,19 +1,26 @@
 #include "RenderTools.h"
-
-#include <fstream>
+#include "ImageWriter.h"
+#include "ObjLoader.h"
+#include "ShpLoader.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <sstream>
+#include <limits>
+#include <random>
 
 //==============================================================================
 //================================ Free functions ==============================
 //==============================================================================
-double get_length(const cv::Vec3d &vec) {
-    return std::sqrt(
-            std::pow(vec[0], 2) + std::pow(vec[1], 2) + std::pow(vec[2], 2));
+Real get_length(const Vec3r &vec) {
+    return std::sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
 }
 
-cv::Vec3d get_normalized(const cv::Vec3d &vec) {
-    double length = get_length(vec);
+Vec3r get_normalized(const Vec3r &vec) {
+    Real length = get_length(vec);
 
     if (length == 0) {
         return vec;
@@ -21,51 +28,295 @@ cv::Vec3d get_normalized(const cv::Vec3d &vec) {
     return vec / length;
 }
 
+Vec3r offsetRayOrigin(const Vec3r &point, const Vec3r &N, Real distance) {
+    Vec3r origin = point + N * distance;
+#ifdef PATH_TRACING_SINGLE_PRECISION
+    // A fixed distance is not enough in float: the rounding error of a hit point grows with
+    // its coordinates. Moving every coordinate by a few hundred ulps along N works at any
+    // scene scale; near zero, where ulps are tiny, a small absolute step is used instead.
+    for (int i = 0; i < 3; i++) {
+        int32_t bits;
+        std::memcpy(&bits, &origin[i], sizeof(bits));
+        int32_t ulps = (int32_t) (256.0f * N[i]);
+        bits += (origin[i] < 0) ? -ulps : ulps;
+        float moved;
+        std::memcpy(&moved, &bits, sizeof(moved));
+        origin[i] = std::abs(origin[i]) < 1.0f / 32.0f ? origin[i] + N[i] / 65536.0f : moved;
+    }
+#endif
+    return origin;
+}
+
 //==============================================================================
 //================================ Ray =========================================
 //==============================================================================
-Ray::Ray(const cv::Vec3d &origin, const cv::Vec3d &direction) : origin(origin),
+Ray::Ray(const Vec3r &origin, const Vec3r &direction) : origin(origin),
                                                                 direction(direction) {
-    cv::Vec3d L{1,1,1};
-    this->L = L;
 }
 
-Ray::Ray(const cv::Vec3d &new_origin, const cv::Vec3d &new_direction,
-         cv::Vec3d L) :
-        origin(new_origin), direction(new_direction),
-        L(std::move(L)) {
+//==============================================================================
+//================================ AABB ========================================
+//==============================================================================
+AABB::AABB() : min(std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max(),
+                   std::numeric_limits<Real>::max()),
+               max(std::numeric_limits<Real>::lowest(), std::numeric_limits<Real>::lowest(),
+                   std::numeric_limits<Real>::lowest()) {
+}
+
+void AABB::expand(const Vec3r &point) {
+    for (int i = 0; i < 3; i++) {
+        min[i] = std::min(min[i], point[i]);
+        max[i] = std::max(max[i], point[i]);
+    }
+}
+
+void AABB::expand(const AABB &box) {
+    for (int i = 0; i < 3; i++) {
+        min[i] = std::min(min[i], box.min[i]);
+        max[i] = std::max(max[i], box.max[i]);
+    }
 }
 
-Ray::Ray(cv::Vec3d L) : L(std::move(L)) {
+void AABB::pad(Real epsilon) {
+    for (int i = 0; i < 3; i++) {
+        Real margin = epsilon * (1 + std::max(std::abs(min[i]), std::abs(max[i])));
+        min[i] -= margin;
+        max[i] += margin;
+    }
 }
 
-Ray Ray::MakeBlackRay() {
-    cv::Vec3d L {0,0,0};
-    return Ray(L);
+Vec3r AABB::getCentroid() const {
+    return (min + max) * 0.5;
+}
+
+Real AABB::getSurfaceArea() const {
+    Vec3r extent = max - min;
+    if (extent[0] < 0 || extent[1] < 0 || extent[2] < 0) {
+        return 0;
+    }
+    return 2 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+}
+
+int AABB::getLongestAxis() const {
+    Vec3r extent = max - min;
+    if (extent[0] >= extent[1] && extent[0] >= extent[2]) {
+        return 0;
+    }
+    return extent[1] >= extent[2] ? 1 : 2;
+}
+
+bool AABB::intersect(const Ray &ray, const Vec3r &inv_direction, Real t_max, Real &t_near) const {
+    Real t_min = 0;
+    for (int i = 0; i < 3; i++) {
+        Real t0 = (min[i] - ray.origin[i]) * inv_direction[i];
+        Real t1 = (max[i] - ray.origin[i]) * inv_direction[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_min = std::max(t_min, t0);
+        t_max = std::min(t_max, t1);
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    t_near = t_min;
+    return true;
+}
+
+bool AABB::intersect(const RayPacket &packet, Real t_max) const {
+    // With a fixed sign, (bound - origin) * inverse direction is monotonic in the inverse
+    // direction, also after rounding, so the ends of its range bound every ray of the packet
+    const Vec3r &origin = packet.rays[0].origin;
+    Real t_min = 0;
+    for (int i = 0; i < 3; i++) {
+        Real near_bound = packet.negative[i] ? max[i] : min[i];
+        Real far_bound = packet.negative[i] ? min[i] : max[i];
+        Real near0 = (near_bound - origin[i]) * packet.invMin[i];
+        Real near1 = (near_bound - origin[i]) * packet.invMax[i];
+        Real far0 = (far_bound - origin[i]) * packet.invMin[i];
+        Real far1 = (far_bound - origin[i]) * packet.invMax[i];
+        t_min = std::max(t_min, std::min(near0, near1));
+        t_max = std::min(t_max, std::max(far0, far1));
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//==============================================================================
+//================================ RayPacket ===================================
+//==============================================================================
+bool RayPacket::set(const Ray *rays, int count) {
+    size = 0;
+    if (count <= 0 || count > maxSize) {
+        return false;
+    }
+    for (int i = 0; i < 3; i++) {
+        negative[i] = rays[0].direction[i] < 0;
+    }
+    for (int k = 0; k < count; k++) {
+        if (rays[k].origin != rays[0].origin) {
+            return false;
+        }
+        for (int i = 0; i < 3; i++) {
+            Real d = rays[k].direction[i];
+            if ((d < 0) != negative[i]) {
+                return false;
+            }
+            // The same inverse as the single-ray traversal, so both take identical slab decisions
+            invDirections[k][i] = 1 / (d != 0 ? d : std::numeric_limits<Real>::min());
+            invMin[i] = k == 0 ? invDirections[k][i] : std::min(invMin[i], invDirections[k][i]);
+            invMax[i] = k == 0 ? invDirections[k][i] : std::max(invMax[i], invDirections[k][i]);
+        }
+        this->rays[k] = rays[k];
+    }
+    size = count;
+    return true;
+}
+
+//==============================================================================
+//================================ Transform ===================================
+//==============================================================================
+Transform::Transform() {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            m[i][j] = (i == j) ? 1 : 0;
+        }
+    }
+}
+
+Transform Transform::translate(const Vec3r &offset) {
+    Transform transform;
+    for (int i = 0; i < 3; i++) {
+        transform.m[i][3] = offset[i];
+    }
+    return transform;
+}
+
+Transform Transform::scale(Real factor) {
+    return scale(Vec3r(factor, factor, factor));
+}
+
+Transform Transform::scale(const Vec3r &factors) {
+    Transform transform;
+    for (int i = 0; i < 3; i++) {
+        transform.m[i][i] = factors[i];
+    }
+    return transform;
+}
+
+Transform Transform::rotate(const Vec3r &axis, Real angle) {
+    // Rodrigues' rotation formula, angle in radians
+    Vec3r a = get_normalized(axis);
+    Real c = std::cos(angle);
+    Real s = std::sin(angle);
+    Transform transform;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            transform.m[i][j] = a[i] * a[j] * (1 - c) + (i == j ? c : 0);
+        }
+    }
+    transform.m[0][1] -= a[2] * s;
+    transform.m[0][2] += a[1] * s;
+    transform.m[1][0] += a[2] * s;
+    transform.m[1][2] -= a[0] * s;
+    transform.m[2][0] -= a[1] * s;
+    transform.m[2][1] += a[0] * s;
+    return transform;
+}
+
+Transform Transform::operator*(const Transform &other) const {
+    Transform result;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            Real value = (j == 3) ? m[i][3] : 0;
+            for (int k = 0; k < 3; k++) {
+                value += m[i][k] * other.m[k][j];
+            }
+            result.m[i][j] = value;
+        }
+    }
+    return result;
+}
+
+Transform Transform::inverse() const {
+    // Inverse of the linear part by cofactors, the translation is moved through it
+    Real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    Transform result;
+    if (det == 0) {
+        return result;
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+            int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            result.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        result.m[i][3] = -(result.m[i][0] * m[0][3] + result.m[i][1] * m[1][3] + result.m[i][2] * m[2][3]);
+    }
+    return result;
+}
+
+Vec3r Transform::applyToPoint(const Vec3r &point) const {
+    Vec3r result;
+    for (int i = 0; i < 3; i++) {
+        result[i] = m[i][0] * point[0] + m[i][1] * point[1] + m[i][2] * point[2] + m[i][3];
+    }
+    return result;
+}
+
+Vec3r Transform::applyToVector(const Vec3r &vector) const {
+    Vec3r result;
+    for (int i = 0; i < 3; i++) {
+        result[i] = m[i][0] * vector[0] + m[i][1] * vector[1] + m[i][2] * vector[2];
+    }
+    return result;
+}
+
+AABB Transform::applyToBounds(const AABB &box) const {
+    AABB result;
+    for (int corner = 0; corner < 8; corner++) {
+        Vec3r point((corner & 1) ? box.max[0] : box.min[0],
+                    (corner & 2) ? box.max[1] : box.min[1],
+                    (corner & 4) ? box.max[2] : box.min[2]);
+        result.expand(applyToPoint(point));
+    }
+    return result;
 }
 
 //==============================================================================
 //================================ Material ====================================
 //==============================================================================
-Material::Material(cv::Vec3d rgb_Kd_color, cv::Vec3d bright_coefficient) :
+Material::Material(Vec3r rgb_Kd_color, Vec3r bright_coefficient) :
         rgb_Kd_color(std::move(rgb_Kd_color)), bright_coefficient(std::move(bright_coefficient)) {
 }
 
 //==============================================================================
 //================================ Triangle ====================================
 //==============================================================================
-Triangle::Triangle(const cv::Vec3d &v0, const cv::Vec3d &v1,
-                   const cv::Vec3d &v2) : v0(v0), v1(v1), v2(v2) {
+Triangle::Triangle(const Vec3r &v0, const Vec3r &v1,
+                   const Vec3r &v2) : v0(v0), v1(v1), v2(v2) {
 }
 
-Triangle::Triangle(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2,
+Triangle::Triangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
                    const Material *material) : v0(v0), v1(v1), v2(v2), material(material) {
 
 }
 
+Triangle::Triangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
+                   const Material *material, int materialId) : v0(v0), v1(v1), v2(v2), material(material),
+                                                               materialId(materialId) {
+
+}
+
 
-cv::Vec3d Triangle::getNormalByObserver(const cv::Vec3d &observer) const {
-    cv::Vec3d normal = (v1 - v0).cross(v2 - v0);
+Vec3r Triangle::getNormalByObserver(const Vec3r &observer) const {
+    Vec3r normal = (v1 - v0).cross(v2 - v0);
 
     normal = get_normalized(normal);
 
@@ -77,48 +328,62 @@ cv::Vec3d Triangle::getNormalByObserver(const cv::Vec3d &observer) const {
     return normal;
 }
 
-bool Triangle::intersect(const Ray &ray, double &t) const {
-    cv::Vec3d e1 = v1 - v0;
-    cv::Vec3d e2 = v2 - v0;
-    cv::Vec3d pvec = ray.direction.cross(e2);
-    double det = e1.dot(pvec);
+bool Triangle::intersect(const Ray &ray, Real &t) const {
+    Vec3r e1 = v1 - v0;
+    Vec3r e2 = v2 - v0;
+    Vec3r pvec = ray.direction.cross(e2);
+    Real det = e1.dot(pvec);
 
-    if (det < 1e-8 && det > -1e-8) {
+    if (det < Real(1e-8) && det > Real(-1e-8)) {
         return false;
     }
 
-    double inv_det = 1 / det;
-    cv::Vec3d tvec = ray.origin - v0;
-    double u = tvec.dot(pvec) * inv_det;
+    Real inv_det = 1 / det;
+    Vec3r tvec = ray.origin - v0;
+    Real u = tvec.dot(pvec) * inv_det;
     if (u < 0 || u > 1) {
         return false;
     }
 
-    cv::Vec3d qvec = tvec.cross(e1);
-    double v = ray.direction.dot(qvec) * inv_det;
+    Vec3r qvec = tvec.cross(e1);
+    Real v = ray.direction.dot(qvec) * inv_det;
     if (v < 0 || v + u > 1) {
         return false;
     }
 
     t = e2.dot(qvec) * inv_det;
-    return t > 1e-8;
+    return t > Real(1e-8);
+}
+
+AABB Triangle::getBounds() const {
+    AABB box;
+    box.expand(v0);
+    box.expand(v1);
+    box.expand(v2);
+    return box;
+}
+
+void Triangle::getVertices(Vec3r &v0, Vec3r &v1, Vec3r &v2) const {
+    v0 = this->v0;
+    v1 = this->v1;
+    v2 = this->v2;
 }
 
 //==============================================================================
 //================================ Light =======================================
 //==============================================================================
-Light::Light(const cv::Vec3d &new_position) : position(
+Light::Light(const Vec3r &new_position) : position(
         new_position) {
 }
 
-Light::Light(const cv::Vec3d &new_position, cv::Vec3d new_spec_intensity) : position(new_position),
+Light::Light(const Vec3r &new_position, Vec3r new_spec_intensity) : position(new_position),
              rgb_intensity(std::move(new_spec_intensity)) {
 }
 
 //==============================================================================
 //================================ Camera ======================================
 //==============================================================================
-Camera::Camera(int width, int height, double fov, const cv::Vec3d &origin)
+Camera::Camera(int width, int height, Real fov, const Vec3r &origin)
         : width(width), height(height), fov(fov), origin(origin) {
 }
 
@@ -130,14 +395,517 @@ int Camera::getHeight() const {
     return height;
 }
 
-double Camera::getFov() const {
+Real Camera::getFov() const {
     return fov;
 }
 
-cv::Vec3d Camera::getPosition() const {
+Vec3r Camera::getPosition() const {
     return origin;
 }
 
+void Camera::setOutputPath(const std::string & outputPath) {
+    this->outputPath = outputPath;
+}
+
+const std::string &Camera::getOutputPath() const {
+    return outputPath;
+}
+
+Ray Camera::getRay(int width, int height, long long i, long long j) const {
+    return getRayThrough(width, height, i + 0.5, j + 0.5);
+}
+
+Ray Camera::getRayThrough(int width, int height, double y, double x, Real lensU, Real lensV) const {
+    double px = -(2 * x / (double) width - 1) * tan(fov / 2.) * width /
+                (double) height;
+    double py = -(2 * y / (double) height - 1) * tan(fov / 2.);
+    Vec3r direction = get_normalized(Vec3r(px, py, -1));
+    if (aperture <= 0) {
+        return Ray(origin, direction);
+    }
+
+    // Concentric mapping of the square onto the disk keeps the stratification of the lens samples
+    Real a = 2 * lensU - 1;
+    Real b = 2 * lensV - 1;
+    Real radius = 0, angle = 0;
+    if (a != 0 || b != 0) {
+        if (std::abs(a) > std::abs(b)) {
+            radius = a;
+            angle = (M_PI / 4) * (b / a);
+        } else {
+            radius = b;
+            angle = M_PI / 2 - (M_PI / 4) * (a / b);
+        }
+    }
+    Vec3r lens_point = origin + aperture * radius * Vec3r(std::cos(angle), std::sin(angle), 0);
+    Vec3r focus_point = origin + (focusDistance / -direction[2]) * direction;
+    return Ray(lens_point, get_normalized(focus_point - lens_point));
+}
+
+Ray Camera::sampleRay(int width, int height, long long i, long long j, Sampler &sampler, bool jitter) const {
+    Real u = 0.5, v = 0.5, lens_u, lens_v;
+    sampler.setDimension(Sampler::pixelDimension);
+    if (jitter) {
+        sampler.get2D(u, v);
+    }
+    sampler.setDimension(Sampler::lensDimension);
+    sampler.get2D(lens_u, lens_v);
+    return getRayThrough(width, height, i + v, j + u, lens_u, lens_v);
+}
+
+void Camera::setLens(const Real & aperture, const Real & focusDistance) {
+    this->aperture = aperture;
+    this->focusDistance = focusDistance;
+}
+
+Real Camera::getAperture() const {
+    return aperture;
+}
+
+Real Camera::getFocusDistance() const {
+    return focusDistance;
+}
+
+//==============================================================================
+//================================ BVH =========================================
+//==============================================================================
+void BVH::clear() {
+    nodes.clear();
+    indices.clear();
+    soa.clear();
+    buildCost = 0;
+}
+
+void BVH::build(const std::vector<Triangle> &triangles) {
+    std::vector<AABB> bounds(triangles.size());
+    for (int i = 0; i < triangles.size(); i++) {
+        bounds[i] = triangles[i].getBounds();
+    }
+    buildNodes(bounds);
+
+    soa.reserve(triangles.size());
+    for (int index : indices) {
+        Vec3r v0, v1, v2;
+        triangles[index].getVertices(v0, v1, v2);
+        soa.push(v0, v1, v2);
+    }
+    soa.finalize();
+}
+
+void BVH::build(const std::vector<Vec3r> &vertices, const std::vector<int> &triangle_indices) {
+    std::vector<AABB> bounds(triangle_indices.size() / 3);
+    for (int i = 0; i < bounds.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            bounds[i].expand(vertices[triangle_indices[3 * i + k]]);
+        }
+    }
+    buildNodes(bounds);
+
+    soa.reserve(bounds.size());
+    for (int index : indices) {
+        soa.push(vertices[triangle_indices[3 * index]], vertices[triangle_indices[3 * index + 1]],
+                 vertices[triangle_indices[3 * index + 2]]);
+    }
+    soa.finalize();
+}
+
+void BVH::build(const std::vector<AABB> &bounds) {
+    buildNodes(bounds);
+}
+
+bool BVH::refit(const std::vector<Triangle> &triangles) {
+    std::vector<AABB> bounds(triangles.size());
+    for (int i = 0; i < triangles.size(); i++) {
+        bounds[i] = triangles[i].getBounds();
+    }
+    for (int k = 0; k < indices.size(); k++) {
+        Vec3r v0, v1, v2;
+        triangles[indices[k]].getVertices(v0, v1, v2);
+        soa.set(k, v0, v1, v2);
+    }
+    return refitNodes(bounds);
+}
+
+bool BVH::refit(const std::vector<AABB> &bounds) {
+    return refitNodes(bounds);
+}
+
+bool BVH::refitNodes(const std::vector<AABB> &bounds) {
+    if (nodes.empty()) {
+        return true;
+    }
+    // A hierarchy read from a scene cache is measured before its first refit
+    if (buildCost == 0) {
+        buildCost = getCost();
+    }
+
+    // Children follow their parents, so one backward pass sees every child before its parent.
+    // The boxes are padded only once merged, exactly as buildRecursive pads them.
+    std::vector<AABB> boxes(nodes.size());
+    for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+        BVHNode &node = nodes[i];
+        if (node.count > 0) {
+            for (int k = node.offset; k < node.offset + node.count; k++) {
+                boxes[i].expand(bounds[indices[k]]);
+            }
+        } else {
+            boxes[i].expand(boxes[i + 1]);
+            boxes[i].expand(boxes[node.offset]);
+        }
+        node.bounds = boxes[i];
+        node.bounds.pad(boundsPadding);
+    }
+    return getCost() <= maxRefitGrowth * buildCost;
+}
+
+Real BVH::getCost() const {
+    // Expected number of nodes a ray through the root visits: the areas of the nodes relative to the root
+    Real root_area = nodes[0].bounds.getSurfaceArea();
+    if (root_area <= 0) {
+        return 1;
+    }
+    Real area = 0;
+    for (const auto &node : nodes) {
+        area += node.bounds.getSurfaceArea();
+    }
+    return area / root_area;
+}
+
+void BVH::buildNodes(const std::vector<AABB> &bounds) {
+    clear();
+    if (bounds.empty()) {
+        return;
+    }
+
+    std::vector<Vec3r> centroids(bounds.size());
+    indices.resize(bounds.size());
+    for (int i = 0; i < bounds.size(); i++) {
+        centroids[i] = bounds[i].getCentroid();
+        indices[i] = i;
+    }
+
+    nodes.reserve(2 * bounds.size());
+    buildRecursive(bounds, centroids, 0, (int) bounds.size(), 0);
+    buildCost = getCost();
+}
+
+int BVH::buildRecursive(const std::vector<AABB> &bounds, const std::vector<Vec3r> &centroids,
+                        int begin, int end, int depth) {
+    int node_index = (int) nodes.size();
+    nodes.emplace_back();
+
+    AABB box, centroid_box;
+    for (int i = begin; i < end; i++) {
+        box.expand(bounds[indices[i]]);
+        centroid_box.expand(centroids[indices[i]]);
+    }
+    // Padding keeps triangles lying in the box faces (axis-aligned planes) inside the box
+    // despite the rounding of the slab test, so the traversal never misses a hit.
+    box.pad(boundsPadding);
+    nodes[node_index].bounds = box;
+
+    int count = end - begin;
+    auto make_leaf = [&]() {
+        nodes[node_index].offset = begin;
+        nodes[node_index].count = count;
+    };
+
+    if (count == 1) {
+        make_leaf();
+        return node_index;
+    }
+
+    // Binned SAH: cost of a split = traversal + sum over children of (area ratio * triangles)
+    Real best_cost = std::numeric_limits<Real>::max();
+    int best_axis = -1;
+    int best_bin = -1;
+    Real parent_area = box.getSurfaceArea();
+
+    for (int axis = 0; axis < 3; axis++) {
+        Real extent = centroid_box.max[axis] - centroid_box.min[axis];
+        if (extent <= 0) {
+            continue;
+        }
+
+        AABB bin_bounds[binsCount];
+        int bin_counts[binsCount] = {};
+        for (int i = begin; i < end; i++) {
+            int bin = std::min(binsCount - 1,
+                               (int) (binsCount * (centroids[indices[i]][axis] - centroid_box.min[axis]) / extent));
+            bin_counts[bin]++;
+            bin_bounds[bin].expand(bounds[indices[i]]);
+        }
+
+        Real right_areas[binsCount];
+        int right_counts[binsCount];
+        AABB right_box;
+        int right_count = 0;
+        for (int bin = binsCount - 1; bin > 0; bin--) {
+            right_box.expand(bin_bounds[bin]);
+            right_count += bin_counts[bin];
+            right_areas[bin] = right_box.getSurfaceArea();
+            right_counts[bin] = right_count;
+        }
+
+        AABB left_box;
+        int left_count = 0;
+        for (int bin = 0; bin < binsCount - 1; bin++) {
+            left_box.expand(bin_bounds[bin]);
+            left_count += bin_counts[bin];
+            if (left_count == 0 || right_counts[bin + 1] == 0) {
+                continue;
+            }
+            Real cost = 1 + (left_box.getSurfaceArea() * left_count +
+                               right_areas[bin + 1] * right_counts[bin + 1]) / parent_area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = bin;
+            }
+        }
+    }
+
+    if (count <= maxLeafSize && (best_axis < 0 || best_cost >= count)) {
+        make_leaf();
+        return node_index;
+    }
+
+    int middle = begin;
+    if (best_axis >= 0 && depth < maxSahDepth) {
+        Real extent = centroid_box.max[best_axis] - centroid_box.min[best_axis];
+        middle = (int) (std::partition(indices.begin() + begin, indices.begin() + end, [&](int index) {
+            int bin = std::min(binsCount - 1,
+                               (int) (binsCount * (centroids[index][best_axis] - centroid_box.min[best_axis]) /
+                                      extent));
+            return bin <= best_bin;
+        }) - indices.begin());
+    }
+
+    // Too deep or all centroids coincide: fall back to a median split along the longest axis
+    if (middle == begin || middle == end) {
+        best_axis = centroid_box.getLongestAxis();
+        middle = (begin + end) / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end,
+                         [&](int a, int b) { return centroids[a][best_axis] < centroids[b][best_axis]; });
+    }
+
+    nodes[node_index].axis = best_axis;
+    buildRecursive(bounds, centroids, begin, middle, depth + 1);
+    nodes[node_index].offset = buildRecursive(bounds, centroids, middle, end, depth + 1);
+    return node_index;
+}
+
+bool BVH::intersect(const Ray &ray, Real &t, int &triangle_index, Real t_max) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    Vec3r inv_direction;
+    for (int i = 0; i < 3; i++) {
+        Real d = ray.direction[i];
+        inv_direction[i] = 1 / (d != 0 ? d : std::numeric_limits<Real>::min());
+    }
+
+    Real min_distance = t_max;
+    int min_index = -1;
+
+    int stack[maxStackSize];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    long long visits = 0, tests = 0;
+
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode &node = nodes[node_index];
+        visits++;
+        Real t_near;
+        // Ties are visited too: an equally distant triangle with a lower index wins, as in the brute force loop
+        if (!node.bounds.intersect(ray, inv_direction, min_distance, t_near)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            Real distances[TriangleSoA::maxBatchSize];
+            int mask = kernel(soa, node.offset, node.count, ray.origin.val, ray.direction.val, distances);
+            tests += node.count;
+            for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+                int index = indices[node.offset + lane];
+                if ((mask & 1) &&
+                    (distances[lane] < min_distance || (distances[lane] == min_distance && index < min_index))) {
+                    min_distance = distances[lane];
+                    min_index = index;
+                }
+            }
+        } else {
+            int left = node_index + 1;
+            int right = node.offset;
+            if (ray.direction[node.axis] < 0) {
+                std::swap(left, right);
+            }
+            stack[stack_size++] = right;
+            stack[stack_size++] = left;
+        }
+    }
+
+    STATS_ADD(nodeVisits, visits);
+    STATS_ADD(triangleTests, tests);
+    if (min_index < 0) {
+        return false;
+    }
+    t = min_distance;
+    triangle_index = min_index;
+    return true;
+}
+
+void BVH::intersect(const RayPacket &packet, uint64_t mask, Real t[], int triangle_index[]) const {
+    // Per ray this is the update of intersect(): the closest hit wins and among equally
+    // distant ones the lowest index, whatever order the leaves are visited in
+    traverseNodes(packet, mask, t, [&](const BVHNode &node, uint64_t hits) {
+        STATS_ADD(triangleTests, (long long) node.count * __builtin_popcountll(hits));
+        for (; hits != 0; hits &= hits - 1) {
+            int k = __builtin_ctzll(hits);
+            const Ray &ray = packet.rays[k];
+            Real distances[TriangleSoA::maxBatchSize];
+            int lanes = kernel(soa, node.offset, node.count, ray.origin.val, ray.direction.val, distances);
+            for (int lane = 0; lanes != 0; lane++, lanes >>= 1) {
+                int index = indices[node.offset + lane];
+                if ((lanes & 1) &&
+                    (distances[lane] < t[k] || (distances[lane] == t[k] && index < triangle_index[k]))) {
+                    t[k] = distances[lane];
+                    triangle_index[k] = index;
+                }
+            }
+        }
+    });
+}
+
+bool BVH::occluded(const Ray &ray, Real t_max) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    Vec3r inv_direction;
+    for (int i = 0; i < 3; i++) {
+        Real d = ray.direction[i];
+        inv_direction[i] = 1 / (d != 0 ? d : std::numeric_limits<Real>::min());
+    }
+
+    int stack[maxStackSize];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    long long visits = 0, tests = 0;
+    bool blocked = false;
+
+    while (stack_size > 0 && !blocked) {
+        int node_index = stack[--stack_size];
+        const BVHNode &node = nodes[node_index];
+        visits++;
+        Real t_near;
+        if (!node.bounds.intersect(ray, inv_direction, t_max, t_near)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            Real distances[TriangleSoA::maxBatchSize];
+            int mask = kernel(soa, node.offset, node.count, ray.origin.val, ray.direction.val, distances);
+            tests += node.count;
+            for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+                if ((mask & 1) && distances[lane] < t_max) {
+                    blocked = true;
+                    break;
+                }
+            }
+        } else {
+            stack[stack_size++] = node.offset;
+            stack[stack_size++] = node_index + 1;
+        }
+    }
+    STATS_ADD(nodeVisits, visits);
+    STATS_ADD(triangleTests, tests);
+    return blocked;
+}
+
+//==============================================================================
+//================================ LightTree ===================================
+//==============================================================================
+void LightTree::build(const std::vector<Light> &lights) {
+    nodes.clear();
+    if (lights.empty()) {
+        return;
+    }
+
+    std::vector<int> order(lights.size());
+    for (int i = 0; i < lights.size(); i++) {
+        order[i] = i;
+    }
+    nodes.reserve(2 * lights.size());
+    buildRecursive(lights, order, 0, (int) lights.size());
+}
+
+int LightTree::buildRecursive(const std::vector<Light> &lights, std::vector<int> &order, int begin, int end) {
+    int node_index = (int) nodes.size();
+    nodes.emplace_back();
+
+    AABB box;
+    Real power = 0;
+    for (int i = begin; i < end; i++) {
+        const Light &light = lights[order[i]];
+        box.expand(light.givePosition());
+        Vec3r intensity = light.giveRGBIntensity();
+        power += std::max(Real(0), intensity[0]) + std::max(Real(0), intensity[1]) + std::max(Real(0), intensity[2]);
+    }
+    nodes[node_index].bounds = box;
+    nodes[node_index].power = power;
+
+    if (end - begin == 1) {
+        nodes[node_index].light = order[begin];
+        return node_index;
+    }
+
+    int axis = box.getLongestAxis();
+    int middle = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) {
+        return lights[a].givePosition()[axis] < lights[b].givePosition()[axis];
+    });
+
+    buildRecursive(lights, order, begin, middle);
+    nodes[node_index].right = buildRecursive(lights, order, middle, end);
+    return node_index;
+}
+
+Real LightTree::importance(const LightTreeNode &node, const Vec3r &point) const {
+    Vec3r to_center = node.bounds.getCentroid() - point;
+    Vec3r half_diagonal = (node.bounds.max - node.bounds.min) * 0.5;
+    // Inside or next to a cluster the distance to its centre means little: clamp it by the cluster size
+    Real distance2 = std::max(to_center.dot(to_center), half_diagonal.dot(half_diagonal));
+    return node.power / std::max(distance2, std::numeric_limits<Real>::min());
+}
+
+int LightTree::sample(const Vec3r &point, Real u, Real &pdf) const {
+    int node_index = 0;
+    pdf = 1;
+    while (nodes[node_index].light < 0) {
+        int left = node_index + 1;
+        int right = nodes[node_index].right;
+        Real left_importance = importance(nodes[left], point);
+        Real right_importance = importance(nodes[right], point);
+        Real total = left_importance + right_importance;
+        Real left_probability = total > 0 ? left_importance / total : Real(0.5);
+
+        if (u < left_probability) {
+            u = u / left_probability;
+            pdf *= left_probability;
+            node_index = left;
+        } else {
+            u = (u - left_probability) / (1 - left_probability);
+            pdf *= 1 - left_probability;
+            node_index = right;
+        }
+        u = std::min(u, Real(1) - std::numeric_limits<Real>::epsilon());
+    }
+    return nodes[node_index].light;
+}
+
 //==============================================================================
 //================================ Scene =======================================
 //==============================================================================
@@ -145,129 +913,599 @@ Scene::Scene() {
 
 }
 
+Scene::~Scene() = default;
+
+void Scene::build() {
+    STATS_TIMER(Build);
+    if (bvhDirty) {
+        bvh.build(triangles);
+        bvhDirty = false;
+    } else if (bvhRefit && !bvh.refit(triangles)) {
+        bvh.build(triangles);
+    }
+    bvhRefit = false;
+    for (auto &mesh : meshes) {
+        if (mesh.dirty) {
+            mesh.bvh.build(mesh.vertices, mesh.indices);
+            mesh.dirty = false;
+        }
+    }
+    if (instancesDirty || instancesRefit) {
+        std::vector<AABB> bounds(instances.size());
+        for (int i = 0; i < instances.size(); i++) {
+            const BVH &mesh_bvh = meshes[instances[i].mesh].bvh;
+            if (mesh_bvh.empty()) {
+                // The inverted box of an empty mesh would turn into inf and NaN bounds; a point at the
+                // instance's origin keeps the binning finite, and the empty mesh reports no hits
+                bounds[i] = AABB();
+                bounds[i].expand(instances[i].objectToWorld.applyToPoint(Vec3r(0, 0, 0)));
+                continue;
+            }
+            bounds[i] = instances[i].objectToWorld.applyToBounds(mesh_bvh.getBounds());
+        }
+        if (instancesDirty || !instancesBvh.refit(bounds)) {
+            instancesBvh.build(bounds);
+        }
+        instancesDirty = false;
+        instancesRefit = false;
+    }
+    if (lightsDirty) {
+        lightTree.build(lights);
+        lightsDirty = false;
+    }
+}
+
 void Scene::setNewCamera(const Camera &camera) {
     cameras.emplace_back(camera);
+    relightPaths.clear();
+}
+
+void Scene::setCamera(const int &id, const Camera &camera) {
+    // Cameras are not assignable (their size and position are const), so the list is copied
+    std::vector<Camera> replaced;
+    replaced.reserve(cameras.size());
+    for (int c = 0; c < cameras.size(); c++) {
+        replaced.emplace_back(c == id ? camera : cameras[c]);
+    }
+    cameras.swap(replaced);
+    relightPaths.clear();
 }
 
 void Scene::setNewMaterial(const Material& material) {
     materials.emplace_back(material);
+    relightPaths.clear();
+}
+
+void Scene::setMaterialName(const std::string & name, const int & id) {
+    materialIds[name] = id;
 }
 
 void Scene::setNewLight(const Light &light) {
     lights.emplace_back(light);
+    lightsDirty = true;
 }
 
-void Scene::setNewTriangle(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2, const int &id) {
-    triangles.emplace_back(Triangle(v0, v1, v2, &materials[id]));
+void Scene::setLight(const int &id, const Light &light) {
+    lights[id] = light;
+    lightsDirty = true;
 }
 
-void Scene::addPlane(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2,
-                     const cv::Vec3d &v3, const int &id) {
-    triangles.emplace_back(Triangle(v0, v1, v2, &materials[id]));
-    triangles.emplace_back(Triangle(v2, v3, v0, &materials[id]));
+void Scene::setNewTriangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2, const int &id) {
+    triangles.emplace_back(Triangle(v0, v1, v2, &materials[id], id));
+    bvhDirty = true;
+    relightPaths.clear();
 }
 
-void Scene::addCube(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2,
-                    const cv::Vec3d &v3, const int &id, const double &depth) {
-    cv::Vec3d normal = get_normalized((v0 - v1).cross(v2 - v1));
-    cv::Vec3d v00 = v0 + normal * depth;
-    cv::Vec3d v10 = v1 + normal * depth;
-    cv::Vec3d v20 = v2 + normal * depth;
-    cv::Vec3d v30 = v3 + normal * depth;
-    addPlane(v0, v1, v2, v3, id);
+int Scene::addMesh(const std::vector<Vec3r> &vertices, const std::vector<int> &indices) {
+    Mesh mesh;
+    mesh.vertices = vertices;
+    mesh.indices = indices;
+    meshes.emplace_back(std::move(mesh));
+    return (int) meshes.size() - 1;
+}
+
+int Scene::addInstance(const int &mesh_id, const Transform &transform, const int &id) {
+    Instance instance;
+    instance.mesh = mesh_id;
+    instance.materialId = id;
+    instance.objectToWorld = transform;
+    instance.worldToObject = transform.inverse();
+    instances.emplace_back(instance);
+    instancesDirty = true;
+    relightPaths.clear();
+    return (int) instances.size() - 1;
+}
+
+int Scene::addPlane(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
+                    const Vec3r &v3, const int &id) {
+    triangles.emplace_back(Triangle(v0, v1, v2, &materials[id], id));
+    triangles.emplace_back(Triangle(v2, v3, v0, &materials[id], id));
+    bvhDirty = true;
+    relightPaths.clear();
+    return (int) triangles.size() - 2;
+}
+
+int Scene::addCube(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
+                   const Vec3r &v3, const int &id, const Real &depth) {
+    Vec3r normal = get_normalized((v0 - v1).cross(v2 - v1));
+    Vec3r v00 = v0 + normal * depth;
+    Vec3r v10 = v1 + normal * depth;
+    Vec3r v20 = v2 + normal * depth;
+    Vec3r v30 = v3 + normal * depth;
+    int first = addPlane(v0, v1, v2, v3, id);
     addPlane(v0, v1, v10, v00, id);
     addPlane(v1, v2, v20, v10, id);
     addPlane(v2, v3, v30, v20, id);
     addPlane(v3, v0, v00, v30, id);
     addPlane(v00, v10, v20, v30, id);
+    return first;
+}
+
+void Scene::transformTriangles(const int &first, const int &count, const Transform &transform) {
+    for (int i = first; i < first + count; i++) {
+        Vec3r v0, v1, v2;
+        triangles[i].getVertices(v0, v1, v2);
+        int id = triangles[i].getMaterialId();
+        triangles[i] = Triangle(transform.applyToPoint(v0), transform.applyToPoint(v1), transform.applyToPoint(v2),
+                                &materials[id], id);
+    }
+    bvhRefit = true;
+    relightPaths.clear();
+}
+
+void Scene::setInstanceTransform(const int &id, const Transform &transform) {
+    instances[id].objectToWorld = transform;
+    instances[id].worldToObject = transform.inverse();
+    instancesRefit = true;
+    relightPaths.clear();
 }
 
 void Scene::setAntialiasing(const bool & antialiasing) {
     this->antialiasing = antialiasing;
+    relightPaths.clear();
 }
 void Scene::setLightInShadows(const bool & lightInShadows) {
     this->lightInShadows = lightInShadows;
 }
+void Scene::setBruteForce(const bool & bruteForce) {
+    this->bruteForce = bruteForce;
+}
+void Scene::setMaxDepth(const int & maxDepth) {
+    this->maxDepth = maxDepth;
+    relightPaths.clear();
+}
+void Scene::setWavefront(const bool & wavefront) {
+    this->wavefront = wavefront;
+}
+void Scene::setLightSamples(const int & lightSamples) {
+    this->lightSamples = lightSamples;
+}
+void Scene::setSampler(const SamplerType & samplerType) {
+    this->samplerType = samplerType;
+    relightPaths.clear();
+}
+void Scene::setPacketTracing(const bool & packetTracing) {
+    this->packetTracing = packetTracing;
+}
+void Scene::setRelightCache(const bool & relightCache) {
+    this->relightCache = relightCache;
+    if (!relightCache) {
+        relightPaths.clear();
+    }
+}
+void Scene::setAdaptiveSampling(const bool & adaptiveSampling) {
+    this->adaptiveSampling = adaptiveSampling;
+}
+void Scene::setAdaptiveThreshold(const Real & adaptiveThreshold) {
+    this->adaptiveThreshold = adaptiveThreshold;
+}
+void Scene::setMaxSamples(const int & maxSamples) {
+    this->maxSamples = std::max(maxSamples, (int) adaptiveBaseSamples);
+}
+void Scene::setRayBudget(const long long & rayBudget) {
+    this->rayBudget = rayBudget;
+}
+void Scene::setProgressive(const bool & progressive) {
+    this->progressive = progressive;
+}
+void Scene::setPreview(const bool & preview) {
+    this->preview = preview;
+}
+void Scene::setProgressReport(const bool & progressReport) {
+    this->progressReport = progressReport;
+}
+void Scene::setTimeBudget(const double & timeBudget) {
+    this->timeBudget = timeBudget;
+}
+void Scene::setConvergenceTarget(const Real & convergenceTarget) {
+    this->convergenceTarget = convergenceTarget;
+}
+void Scene::setMaxPasses(const int & maxPasses) {
+    this->maxPasses = std::max(maxPasses, 0);
+}
+void Scene::setStatsPath(const std::string & statsPath) {
+    this->statsPath = statsPath;
+}
+void Scene::setTileTimeout(const double & tileTimeout) {
+    this->tileTimeout = tileTimeout;
+}
+void Scene::setSpectral(const bool & spectral) {
+    this->spectral = spectral;
+    relightPaths.clear();
+}
+void Scene::setMaterialSpectrum(const int & id, const Spectrum & reflectance) {
+    if (materialSpectra.size() <= id) {
+        materialSpectra.resize(id + 1);
+    }
+    materialSpectra[id] = reflectance;
+}
+void Scene::setLightSpectrum(const int & id, const Spectrum & intensity) {
+    if (lightSpectra.size() <= id) {
+        lightSpectra.resize(id + 1);
+    }
+    lightSpectra[id] = intensity;
+}
+
+void Scene::setThreadsCount(const int & threadsCount) {
+    this->threadsCount = threadsCount;
+    pool.reset();
+}
 
-bool Scene::intersect(const Ray &ray, cv::Vec3d &positionOfHit, cv::Vec3d &N, Material &material) {
+bool Scene::useHierarchies() const {
+    return !bruteForce && !bvhDirty && !instancesDirty && !bvhRefit && !instancesRefit;
+}
+
+bool Scene::closestHit(const Ray &ray, Hit &hit) const {
+    hit.triangle = -1;
+    hit.instance = -1;
+
+    if (useHierarchies()) {
+        Real t_max = std::numeric_limits<Real>::max();
+        if (bvh.intersect(ray, hit.t, hit.triangle)) {
+            t_max = hit.t;
+        }
+        // Instances are tested in object space. The direction is not renormalized,
+        // so distances along the transformed ray are world distances.
+        instancesBvh.traverse(ray, t_max, [&](int index, Real &t_limit) {
+            const Instance &instance = instances[index];
+            Ray local(instance.worldToObject.applyToPoint(ray.origin),
+                      instance.worldToObject.applyToVector(ray.direction));
+            Real t;
+            int triangle_index;
+            if (meshes[instance.mesh].bvh.intersect(local, t, triangle_index, t_limit)) {
+                t_limit = t;
+                hit.t = t;
+                hit.triangle = triangle_index;
+                hit.instance = index;
+            }
+            return false;
+        });
+        return hit.triangle >= 0;
+    }
 
-    double min_distance_to_triangle = std::numeric_limits<double>::max();
+    // Reference path: every triangle is tested
+    Real min_distance_to_triangle = std::numeric_limits<Real>::max();
+    STATS_ADD(triangleTests, (long long) triangles.size());
 
-    for (auto &triangle : triangles) {
-        double distance_to_triangle = -1.0;
-        if (triangle.intersect(ray, distance_to_triangle) &&
+    for (int i = 0; i < triangles.size(); i++) {
+        Real distance_to_triangle = -1.0;
+        if (triangles[i].intersect(ray, distance_to_triangle) &&
             distance_to_triangle < min_distance_to_triangle) {
             min_distance_to_triangle = distance_to_triangle;
-            positionOfHit = ray.origin + ray.direction * distance_to_triangle;
-            N = triangle.getNormalByObserver(ray.origin - positionOfHit);
-            material = triangle.giveMaterial();
+            hit.triangle = i;
         }
     }
 
-    return min_distance_to_triangle < std::numeric_limits<double>::max();
+    for (int i = 0; i < instances.size(); i++) {
+        const Instance &instance = instances[i];
+        const Mesh &mesh = meshes[instance.mesh];
+        Ray local(instance.worldToObject.applyToPoint(ray.origin),
+                  instance.worldToObject.applyToVector(ray.direction));
+        STATS_ADD(triangleTests, (long long) mesh.indices.size() / 3);
+        for (int k = 0; k < mesh.indices.size() / 3; k++) {
+            Triangle triangle(mesh.vertices[mesh.indices[3 * k]], mesh.vertices[mesh.indices[3 * k + 1]],
+                              mesh.vertices[mesh.indices[3 * k + 2]]);
+            Real distance_to_triangle = -1.0;
+            if (triangle.intersect(local, distance_to_triangle) &&
+                distance_to_triangle < min_distance_to_triangle) {
+                min_distance_to_triangle = distance_to_triangle;
+                hit.triangle = k;
+                hit.instance = i;
+            }
+        }
+    }
+
+    hit.t = min_distance_to_triangle;
+    return hit.triangle >= 0;
 }
 
-Ray Scene::fireRay(Ray &ray) {
-    cv::Vec3d hitRayIntersection, N;
-    Material material;
+void Scene::closestHit(const RayPacket &packet, Hit hits[]) const {
+    if (!useHierarchies()) {
+        for (int k = 0; k < packet.size; k++) {
+            closestHit(packet.rays[k], hits[k]);
+        }
+        return;
+    }
 
-    if (!intersect(ray, hitRayIntersection, N, material)) {
-        return ray.MakeBlackRay();  //ray intersect no one triangle
+    Real t[RayPacket::maxSize];
+    int triangle_index[RayPacket::maxSize];
+    for (int k = 0; k < packet.size; k++) {
+        t[k] = std::numeric_limits<Real>::max();
+        triangle_index[k] = -1;
+    }
+    bvh.intersect(packet, packet.getFullMask(), t, triangle_index);
+    for (int k = 0; k < packet.size; k++) {
+        hits[k].t = t[k];
+        hits[k].triangle = triangle_index[k];
+        hits[k].instance = -1;
     }
 
-    Ray rasultRay(cv::Vec3d{0,0,0});
+    // Every ray sees the instances in the order it would alone, which settles equally distant hits alike
+    instancesBvh.traverse(packet, packet.getFullMask(), t, [&](int index, uint64_t mask, Real t_limit[]) {
+        const Instance &instance = instances[index];
+        const BVH &mesh_bvh = meshes[instance.mesh].bvh;
+        Ray local_rays[RayPacket::maxSize];
+        for (int k = 0; k < packet.size; k++) {
+            local_rays[k] = Ray(instance.worldToObject.applyToPoint(packet.rays[k].origin),
+                                instance.worldToObject.applyToVector(packet.rays[k].direction));
+        }
 
-    for (int i = 0; i < lights.size(); i++) {
+        // A rotation can split the packet between octants, then its rays go one at a time
+        RayPacket local;
+        if (!local.set(local_rays, packet.size)) {
+            for (uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+                int k = __builtin_ctzll(rest);
+                Real t_hit;
+                int triangle;
+                if (mesh_bvh.intersect(local_rays[k], t_hit, triangle, t_limit[k])) {
+                    t_limit[k] = t_hit;
+                    hits[k] = {t_hit, triangle, index};
+                }
+            }
+            return;
+        }
+
+        Real local_t[RayPacket::maxSize];
+        int local_triangle[RayPacket::maxSize];
+        for (uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+            int k = __builtin_ctzll(rest);
+            local_t[k] = t_limit[k];
+            local_triangle[k] = -1;
+        }
+        mesh_bvh.intersect(local, mask, local_t, local_triangle);
+        for (uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+            int k = __builtin_ctzll(rest);
+            if (local_triangle[k] >= 0) {
+                t_limit[k] = local_t[k];
+                hits[k] = {local_t[k], local_triangle[k], index};
+            }
+        }
+    });
+}
+
+void Scene::getHitSurface(const Ray &ray, const Hit &hit, Vec3r &positionOfHit, Vec3r &N,
+                          Material &material) const {
+    positionOfHit = ray.origin + ray.direction * hit.t;
+    if (hit.instance < 0) {
+        N = triangles[hit.triangle].getNormalByObserver(ray.origin - positionOfHit);
+        material = triangles[hit.triangle].giveMaterial();
+        return;
+    }
+
+    // The normal is taken from the world-space triangle, which also handles non-uniform scaling
+    const Instance &instance = instances[hit.instance];
+    const Mesh &mesh = meshes[instance.mesh];
+    Triangle triangle(instance.objectToWorld.applyToPoint(mesh.vertices[mesh.indices[3 * hit.triangle]]),
+                      instance.objectToWorld.applyToPoint(mesh.vertices[mesh.indices[3 * hit.triangle + 1]]),
+                      instance.objectToWorld.applyToPoint(mesh.vertices[mesh.indices[3 * hit.triangle + 2]]));
+    N = triangle.getNormalByObserver(ray.origin - positionOfHit);
+    material = materials[instance.materialId];
+}
+
+int Scene::getHitMaterialId(const Hit &hit) const {
+    if (hit.instance < 0) {
+        return triangles[hit.triangle].getMaterialId();
+    }
+    return instances[hit.instance].materialId;
+}
+
+bool Scene::intersect(const Ray &ray, Vec3r &positionOfHit, Vec3r &N, Material &material) const {
+    Hit hit;
+    if (!closestHit(ray, hit)) {
+        return false;
+    }
+    getHitSurface(ray, hit, positionOfHit, N, material);
+    return true;
+}
+
+bool Scene::occluded(const Ray &ray, Real t_max) const {
+    STATS_ADD(shadowRays, 1);
+    if (useHierarchies()) {
+        if (bvh.occluded(ray, t_max)) {
+            return true;
+        }
+        bool blocked = false;
+        instancesBvh.traverse(ray, t_max, [&](int index, Real &) {
+            const Instance &instance = instances[index];
+            Ray local(instance.worldToObject.applyToPoint(ray.origin),
+                      instance.worldToObject.applyToVector(ray.direction));
+            blocked = meshes[instance.mesh].bvh.occluded(local, t_max);
+            return blocked;
+        });
+        return blocked;
+    }
+
+    for (const auto &triangle : triangles) {
+        STATS_ADD(triangleTests, 1);
+        Real distance_to_triangle = -1.0;
+        if (triangle.intersect(ray, distance_to_triangle) && distance_to_triangle < t_max) {
+            return true;
+        }
+    }
+    for (const auto &instance : instances) {
+        const Mesh &mesh = meshes[instance.mesh];
+        Ray local(instance.worldToObject.applyToPoint(ray.origin),
+                  instance.worldToObject.applyToVector(ray.direction));
+        for (int k = 0; k < mesh.indices.size() / 3; k++) {
+            Triangle triangle(mesh.vertices[mesh.indices[3 * k]], mesh.vertices[mesh.indices[3 * k + 1]],
+                              mesh.vertices[mesh.indices[3 * k + 2]]);
+            STATS_ADD(triangleTests, 1);
+            Real distance_to_triangle = -1.0;
+            if (triangle.intersect(local, distance_to_triangle) && distance_to_triangle < t_max) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Scene::sampleLight(const Light &light, const Vec3r &hitRayIntersection, const Vec3r &N,
+                        const Material &material, const Vec3r &L, LightSample &sample) const {
+    Vec3r light_dir = get_normalized(light.givePosition() - hitRayIntersection);
+    Real dist = get_length(light.givePosition() - hitRayIntersection);
+    Real cos_theta = light_dir.dot(N);
+
+    if (cos_theta <= 0 && lightInShadows) {   //triangle unlit
+        Vec3r E =-0.008 * light.giveRGBIntensity() * cos_theta / (dist * dist);
+        sample.lit = (1- material.giveBRDF())*E.mul(material.giveRGBCOlod().mul(L));
+        sample.test = false;
+        return;
+    }
+
+    Vec3r E = light.giveRGBIntensity() * cos_theta / (dist * dist);
+    sample.lit = (1 - material.giveBRDF()) * E.mul(material.giveRGBCOlod().mul(L));
+    sample.test = lightInShadows;
+    if (sample.test) {
+        Vec3r shadow_origin = offsetRayOrigin(hitRayIntersection, N, 1e-3);
+        sample.shadowRay = Ray(shadow_origin, light_dir);
+        sample.distance = dist;
+        E = 0.008 * light.giveRGBIntensity() * cos_theta / (dist * dist);      //triangle in shadow
+        sample.shadowed = (1- material.giveBRDF())*E.mul(material.giveRGBCOlod().mul(L));
+    }
+}
+
+int Scene::getLightsPerHit() const {
+    if (lightSamples > 0 && lightSamples < lights.size() && !lightsDirty) {
+        return lightSamples;
+    }
+    return (int) lights.size();
+}
+
+int Scene::chooseLight(int sample, const Vec3r &point, Sampler &sampler, Real &scale) const {
+    if (getLightsPerHit() == lights.size()) {
+        scale = 1;
+        return sample;
+    }
+
+    // Importance sampling from the light tree, the pdf in scale keeps the estimate unbiased
+    Real pdf;
+    int light = lightTree.sample(point, sampler.get1D(), pdf);
+    scale = 1 / (lightSamples * pdf);
+    return light;
+}
+
+Vec3r Scene::lightContribution(const Light &light, const Vec3r &hitRayIntersection, const Vec3r &N,
+                               const Material &material, const Vec3r &L) const {
+    LightSample sample;
+    sampleLight(light, hitRayIntersection, N, material, L, sample);
+    if (sample.test && occluded(sample.shadowRay, sample.distance)) {
+        return sample.shadowed;
+    }
+    return sample.lit;
+}
+
+Vec3r Scene::fireRay(Ray &ray, unsigned int seed) const {
+    Sampler sampler(samplerType, seed, 0, Sampler::pathDimension);
+    return fireRay(ray, sampler);
+}
+
+Vec3r Scene::fireRay(Ray &ray, Sampler &sampler) const {
+    return tracePath(ray, sampler, nullptr);
+}
+
+void Scene::addLights(const Vec3r &point, const Vec3r &N, const Material &material, const Vec3r &L, Real weight,
+                      Sampler &sampler, Vec3r &radiance) const {
+    for (int s = 0; s < getLightsPerHit(); s++) {
+        Real scale;
+        int light = chooseLight(s, point, sampler, scale);
+        radiance += (weight * scale) * lightContribution(lights[light], point, N, material, L);
+    }
+}
+
+Vec3r Scene::tracePath(Ray &ray, Sampler &sampler, const Hit *first, std::vector<RelightVertex> *record) const {
+    if (spectral) {
+        return traceSpectral(ray, sampler, first);
+    }
+
+    Vec3r radiance(0, 0, 0);
+    Ray pathRay = ray;
+    Vec3r throughput(1, 1, 1);
+    Real weight = 1;       // every bounce is divided by PI
+    int surfaces = 0;
+
+    for (int depth = 0; depth < maxDepth; depth++) {
+        Hit hit;
+        if (depth == 0 && first) {
+            hit = *first;
+        } else {
+            closestHit(pathRay, hit);
+        }
+        if (depth > 0) {
+            STATS_ADD(reflectionRays, 1);
+        }
+        if (hit.triangle < 0) {
+            break;  //ray intersect no one triangle
+        }
+        surfaces++;
+        Vec3r hitRayIntersection, N;
+        Material material;
+        getHitSurface(pathRay, hit, hitRayIntersection, N, material);
+
+        weight /= M_PI;
+        if (record) {
+            record->push_back({hitRayIntersection, N, throughput, weight, getHitMaterialId(hit), sampler.getDimension()});
+        }
+        addLights(hitRayIntersection, N, material, throughput, weight, sampler, radiance);
 
-        cv::Vec3d light_dir = get_normalized(lights[i].givePosition() - hitRayIntersection);
-        double dist = get_length(lights[i].givePosition() - hitRayIntersection);
-        double cos_theta = light_dir.dot(N);
-
-        if ((material.giveBRDF() != 0) && ((ray.L[0] + ray.L[1] + ray.L[2]) > 0.0005)) {   //reflection
-            cv::Vec3d reflactionL = material.giveBRDF() * material.giveRGBCOlod().mul(ray.L);
-            Ray reflectionRay = Ray(hitRayIntersection, get_normalized(ray.direction + 2 * N), reflactionL);
-            reflectionRay = fireRay(reflectionRay);
-            rasultRay.L = reflectionRay.L;
-        }
-
-        if (cos_theta <= 0 && lightInShadows) {   //triangle unlit
-                cv::Vec3d E =-0.008 * lights[i].giveRGBIntensity() * cos_theta / pow(dist, 2);
-                rasultRay.L += (1- material.giveBRDF())*E.mul(material.giveRGBCOlod().mul(ray.L));
-        }
-        else {
-            cv::Vec3d shadow_origin = hitRayIntersection + N * 1e-3;
-            Ray shadow_ray = Ray(shadow_origin, light_dir);
-            cv::Vec3d shadow_hit, shadow_N;
-            Material shadow_material;
-
-            if (intersect(shadow_ray, shadow_hit, shadow_N, shadow_material) &&
-                get_length(shadow_hit - shadow_origin) < dist && lightInShadows) {        //triangle in shadow
-                    cv::Vec3d E = 0.008 * lights[i].giveRGBIntensity() * cos_theta / pow(dist, 2);
-                    rasultRay.L += (1- material.giveBRDF())*E.mul(material.giveRGBCOlod().mul(ray.L));
-            }else {
-                cv::Vec3d E = lights[i].giveRGBIntensity() * cos_theta / (dist * dist);
-                rasultRay.L += (1 - material.giveBRDF()) * E.mul(material.giveRGBCOlod().mul(ray.L));
+        if (material.giveBRDF() == 0) {
+            break;
+        }
+
+        // Reflection is traced once per bounce, whatever the number of lights
+        Vec3r reflactionL = material.giveBRDF() * material.giveRGBCOlod().mul(throughput);
+
+        // Russian roulette: paths that can no longer contribute much survive with a probability
+        // proportional to their weight and are boosted by its inverse, which keeps the estimate unbiased
+        Real contribution = weight * std::max({reflactionL[0], reflactionL[1], reflactionL[2]});
+        if (contribution < rouletteThreshold) {
+            Real survival = contribution / rouletteThreshold;
+            if (sampler.get1D() >= survival) {
+                break;
             }
+            reflactionL /= survival;
         }
+
+        pathRay = Ray(offsetRayOrigin(hitRayIntersection, N, 0), get_normalized(pathRay.direction + 2 * N));
+        throughput = reflactionL;
     }
-    rasultRay.L /= M_PI;
-    return rasultRay;
+    STATS_DEPTH(surfaces, 1);
+    return radiance;
 }
 
 int Scene::loadCornellBox(const std::string &path_to_file) {
     // Materials
-    cv::Vec3d bright_coefs(1,1,1);
+    Vec3d bright_coefs(1,1,1);
 
-    cv::Vec3d rgb_Kd_color_brs_0 {0.735922, 0.7363956, 0.7373938};
+    Vec3d rgb_Kd_color_brs_0 {0.735922, 0.7363956, 0.7373938};
     materials.emplace_back(Material(rgb_Kd_color_brs_0, bright_coefs));
 
-    cv::Vec3d rgb_Kd_color_brs_1 {0.09629525, 0.4120723, 0.08873872};
+    Vec3d rgb_Kd_color_brs_1 {0.09629525, 0.4120723, 0.08873872};
     materials.emplace_back(Material(rgb_Kd_color_brs_1, bright_coefs));
 
-    cv::Vec3d rgb_Kd_color_brs_2 {0.4407372, 0.04373143, 0.04556723};
+    Vec3d rgb_Kd_color_brs_2 {0.4407372, 0.04373143, 0.04556723};
     materials.emplace_back(Material(rgb_Kd_color_brs_2, bright_coefs));
 
-    cv::Vec3d rgb_Kd_color_brs_3 {0.735922, 0.7363956, 0.7373938};
+    Vec3d rgb_Kd_color_brs_3 {0.735922, 0.7363956, 0.7373938};
     materials.emplace_back(Material(rgb_Kd_color_brs_3, bright_coefs));
 
     // Lights
@@ -277,200 +1515,626 @@ int Scene::loadCornellBox(const std::string &path_to_file) {
     double Isim_b =  0.135;
     double Itotal = Isim_r + Isim_g + Isim_b;
 
-    cv::Vec3d rgb_intensity {total_intensity * (Isim_r / Itotal),
+    Vec3d rgb_intensity {total_intensity * (Isim_r / Itotal),
                              total_intensity * (Isim_g / Itotal),
                              total_intensity * (Isim_b / Itotal)};
 
-    Light a = Light(cv::Vec3d(278, 548.7, -279.5), rgb_intensity);
+    Light a = Light(Vec3d(278, 548.7, -279.5), rgb_intensity);
     lights.push_back(a);
+    lightsDirty = true;
+
+    // Spectra of the Lumicept scene (cornel_box0.iof, the SpecSurfColor and SpecLightColor
+    // objects), the data the RGB values above stand for. The reflectances are sampled
+    // every 4 nm over [400, 700]; the light's relative curve is scaled to the total intensity
+    // over the same range.
+    std::vector<Real> reflectance_wavelengths;
+    for (int wavelength = 400; wavelength <= 700; wavelength += 4) {
+        reflectance_wavelengths.push_back(wavelength);
+    }
+    Spectrum white(reflectance_wavelengths, {
+        0.343, 0.445, 0.551, 0.624, 0.665, 0.687, 0.708, 0.723, 0.715, 0.71, 0.745, 0.758, 0.739, 0.767,
+        0.777, 0.765, 0.751, 0.745, 0.748, 0.729, 0.745, 0.757, 0.753, 0.75, 0.746, 0.747, 0.735, 0.732,
+        0.739, 0.734, 0.725, 0.721, 0.733, 0.725, 0.732, 0.743, 0.744, 0.748, 0.728, 0.716, 0.733, 0.726,
+        0.713, 0.74, 0.754, 0.764, 0.752, 0.736, 0.734, 0.741, 0.74, 0.732, 0.745, 0.755, 0.751, 0.744,
+        0.731, 0.733, 0.744, 0.731, 0.712, 0.708, 0.729, 0.73, 0.727, 0.707, 0.703, 0.729, 0.75, 0.76, 0.751,
+        0.739, 0.724, 0.73, 0.74, 0.737});
+    Spectrum green(reflectance_wavelengths, {
+        0.092, 0.096, 0.098, 0.097, 0.098, 0.095, 0.095, 0.097, 0.095, 0.094, 0.097, 0.098, 0.096, 0.101,
+        0.103, 0.104, 0.107, 0.109, 0.112, 0.115, 0.125, 0.14, 0.16, 0.187, 0.229, 0.285, 0.343, 0.39, 0.435,
+        0.464, 0.472, 0.476, 0.481, 0.462, 0.447, 0.441, 0.426, 0.406, 0.373, 0.347, 0.337, 0.314, 0.285,
+        0.277, 0.266, 0.25, 0.23, 0.207, 0.186, 0.171, 0.16, 0.148, 0.141, 0.136, 0.13, 0.126, 0.123, 0.121,
+        0.122, 0.119, 0.114, 0.115, 0.117, 0.117, 0.118, 0.12, 0.122, 0.128, 0.132, 0.139, 0.144, 0.146,
+        0.15, 0.152, 0.157, 0.159});
+    Spectrum red(reflectance_wavelengths, {
+        0.04, 0.046, 0.048, 0.053, 0.049, 0.05, 0.053, 0.055, 0.057, 0.056, 0.059, 0.057, 0.061, 0.061, 0.06,
+        0.062, 0.062, 0.062, 0.061, 0.062, 0.06, 0.059, 0.057, 0.058, 0.058, 0.058, 0.056, 0.055, 0.056,
+        0.059, 0.057, 0.055, 0.059, 0.059, 0.058, 0.059, 0.061, 0.061, 0.063, 0.063, 0.067, 0.068, 0.072,
+        0.08, 0.09, 0.099, 0.124, 0.154, 0.192, 0.255, 0.287, 0.349, 0.402, 0.443, 0.487, 0.513, 0.558,
+        0.584, 0.62, 0.606, 0.609, 0.651, 0.612, 0.61, 0.65, 0.638, 0.627, 0.62, 0.63, 0.628, 0.642, 0.639,
+        0.657, 0.639, 0.635, 0.642});
+    setMaterialSpectrum(0, white);
+    setMaterialSpectrum(1, green);
+    setMaterialSpectrum(2, red);
+    setMaterialSpectrum(3, white);
+
+    Real light_scale = Real(total_intensity / 3280.0);   // the curve integrates to 3280 over [400, 700]
+    setLightSpectrum(0, Spectrum({400, 500, 600, 700},
+                                 {0, Real(8) * light_scale, Real(15.6) * light_scale, Real(18.4) * light_scale}));
+
+    // Breps are matched to the materials by name, the two boxes share one
+    setMaterialName("brs_0", 0);
+    setMaterialName("brs_1", 1);
+    setMaterialName("brs_2", 2);
+    setMaterialName("brs_3", 3);
+    setMaterialName("brs_4", 3);
+
+    return loadBreps(path_to_file);
+}
 
-    // Triangles
-    int exit_code = 0;
-
-    std::string s;
-    std::ifstream file(path_to_file);
-    std::vector<cv::Vec3d> points;
-
-    while (getline(file, s)) {
-
-        if (s.find("Number of vertices") != std::string::npos) {
-            std::istringstream iss(s);
-            std::string oneString;
-            iss >> oneString;
-            iss >> oneString;
-            points.clear();
-            points.resize(stod(oneString));
-            for(int i = 0; i < stod(oneString); i++){
-                getline(file, s);
-                std::istringstream oss(s);
-                cv::Vec3d pointPosition;
-                int j = 0;
-                for (std::string temp; oss >> temp;){
-                    pointPosition[j++] = stod(temp);
-                }
-                points[i] = pointPosition;
-            }
-        }
+int Scene::loadBreps(const std::string &path_to_file) {
+    STATS_TIMER(Load);
+    ShpScene shp;
+    if (int exit_code = loadShp(path_to_file, shp); exit_code != 0) {
+        return exit_code;
+    }
 
-        if (s.find("Number of triangles") != std::string::npos) {
-            std::istringstream iss(s);
-            std::string oneString;
-            iss >> oneString;
-            iss >> oneString;
-            for(int i = 0; i < stod(oneString); i++){
-                getline(file, s);
-                std::istringstream oss(s);
-                cv::Vec3i numberOfVertex;
-                int j = 0;
-                for (std::string temp; oss >> temp;){
-                    numberOfVertex[j++] = stod(temp);
-                }
-                if(stod(oneString) == 32)
-                    setNewTriangle( points[numberOfVertex[0]], points[numberOfVertex[1]], points[numberOfVertex[2]], 0);
-                if(stod(oneString) == 2)
-                    setNewTriangle( points[numberOfVertex[0]], points[numberOfVertex[1]], points[numberOfVertex[2]], 1);
-                if(stod(oneString) == 6)
-                    setNewTriangle( points[numberOfVertex[0]], points[numberOfVertex[1]], points[numberOfVertex[2]], 2);
-                if(stod(oneString) == 12)
-                    setNewTriangle( points[numberOfVertex[0]], points[numberOfVertex[1]], points[numberOfVertex[2]], 3);
-            }
+    std::vector<int> mesh_ids(shp.breps.size());
+    for (int i = 0; i < shp.breps.size(); i++) {
+        mesh_ids[i] = addMesh(shp.breps[i].vertices, shp.breps[i].indices);
+    }
+    for (const auto &placement : shp.placements) {
+        auto found = materialIds.find(shp.breps[placement.brep].name);
+        if (found == materialIds.end()) {
+            return 4;
         }
+        addInstance(mesh_ids[placement.brep], placement.transform, found->second);
+    }
+    return 0;
+}
 
+int Scene::loadMesh(const std::string &path_to_file, int &mesh_id) {
+    STATS_TIMER(Load);
+    ObjMesh mesh;
+    if (int exit_code = loadObj(path_to_file, mesh, &getPool()); exit_code != 0) {
+        return exit_code;
+    }
+    mesh_id = addMesh(mesh.vertices, mesh.indices);
+    return 0;
+}
+
+int Scene::loadTeapot(const std::string &path_to_file) {
+
+    // One instance of the teapot mesh, scaled and moved into the box
+    int mesh_id;
+    int exit_code = loadMesh(path_to_file, mesh_id);
+    if (exit_code != 0) {
+        return exit_code;
     }
 
-    file.close();
+    Vec3r translation = {400,0,-300};
+    addInstance(mesh_id, Transform::translate(translation) * Transform::scale(85), 3);
 
     return exit_code;
 }
 
-int Scene::loadTeapot(const std::string &path_to_file) {
+void Scene::loadDefaultScene() {
+    // Materials
+    Vec3d bright_coefs {1,1,1};
+
+    Vec3d rgbGrass{0.1,0.4,0.1};
+    setNewMaterial({rgbGrass, bright_coefs});
+
+    Vec3d rgbSky {0.05,0.9,0.99};
+    setNewMaterial({rgbSky, bright_coefs});
+
+    Vec3d redBox{0.8,0.2,0.3};
+    setNewMaterial({redBox, bright_coefs});
+
+    Vec3d whiteBox{0.3,0.3,0.3};
+    setNewMaterial({whiteBox, bright_coefs});
+
+    Vec3d mirror{1,1,1};
+    Material materialOfMirror = Material{mirror, bright_coefs};
+    materialOfMirror.setBRDF(1);
+    setNewMaterial(materialOfMirror);
+
+    Vec3d mirrorBox{0.90588, 0.8196, 0.078};
+    Material materialOfMirrorBox = Material{mirrorBox, bright_coefs};
+    materialOfMirrorBox.setBRDF(0.97);
+    setNewMaterial(materialOfMirrorBox);
+
+    // Geometry
+    Vec3d v0G{-500, 0, 50};
+    Vec3d v1G{1000, 0, 50};
+    Vec3d v2G{1000, 0, -2000};
+    Vec3d v3G{-500, 0, -2000};
+    addPlane(v0G, v1G, v2G, v3G, 0);
+
+    v0G = {10000, -5000, -2000};
+    v1G = {-2000, -5000, -2000};
+    v2G = {-2000, 5000, -2000};
+    v3G = {10000, 5000, -2000};
+    addPlane(v0G, v1G, v2G, v3G, 1);
+
+    v0G = {100, 0, -300};
+    v1G = {250, 0, -400};
+    v2G = {250, 150, -400};
+    v3G = {100, 150, -300};
+    addCube(v0G, v1G, v2G, v3G, 2, 100);
+
+    v0G = {600, 0, -150};
+    v1G = {480, 0, -800};
+    v2G = {480, 100, -800};
+    v3G = {600, 100, -150};
+    addCube(v0G, v1G, v2G, v3G, 3, 100);
+
+    v0G = {750, 0, -900};
+    v1G = {300, 0, -1100};
+    v2G = {200, 500, -1000};
+    v3G = {650, 500, -800};
+    addPlane(v0G, v1G, v2G, v3G, 4);
+
+    v0G = {0,  0,  -75};
+    v1G = {150, 0,  -50};
+    v2G = {150, 200,-50};
+    v3G = {0,  200,-75};
+    addCube(v0G, v1G, v2G, v3G, 5, 150);
+
+    // Lights
+    int total_intensity = 1.816936e+07; // W/sr
+    double Isim_r = 900;
+    double Isim_g = 600;
+    double Isim_b = 600;
+    double Itotal = Isim_r + Isim_g + Isim_b;
+
+    Vec3d spec_intensity{total_intensity * (Isim_r / Itotal),
+                             total_intensity * (Isim_g / Itotal),
+                             total_intensity * (Isim_b / Itotal)};
+
+    Light a = Light(Vec3d(600, 600, -500), spec_intensity);
+    setNewLight(a);
+}
 
-    // Triangles
-    int exit_code = 0;
+ThreadPool &Scene::getPool() {
+    if (!pool) {
+        pool = std::make_unique<ThreadPool>(threadsCount);
+    }
+    return *pool;
+}
+
+void Scene::traceRegion(const Camera &camera, int width, int height, int x0, int y0, int x1, int y1,
+                        Vec3r *radiance, RelightTile *record) const {
+    if (record) {
+        record->ranges.resize((size_t) (x1 - x0) * (y1 - y0));
+        record->vertices.clear();
+    }
+    Ray rays[RayPacket::maxSize];
+    Sampler samplers[RayPacket::maxSize];
+    Hit hits[RayPacket::maxSize];
+    RayPacket packet;
+    for (int block_y = y0; block_y < y1; block_y += packetSide) {
+        for (int block_x = x0; block_x < x1; block_x += packetSide) {
+            int block_y1 = std::min(block_y + packetSide, y1);
+            int block_x1 = std::min(block_x + packetSide, x1);
+            int count = 0;
+            for (long long i = block_y; i < block_y1; i++) {
+                for (long long j = block_x; j < block_x1; j++, count++) {
+                    samplers[count] = Sampler(samplerType, j + i * width, 0);
+                    rays[count] = camera.sampleRay(width, height, i, j, samplers[count], false);
+                }
+            }
+            STATS_ADD(cameraRays, count);
 
-    std::string s;
-    std::ifstream file(path_to_file);
+            bool coherent = packetTracing && packet.set(rays, count);
+            if (coherent) {
+                closestHit(packet, hits);
+            }
+            count = 0;
+            for (int i = block_y; i < block_y1; i++) {
+                for (int j = block_x; j < block_x1; j++, count++) {
+                    size_t k = (j - x0) + (size_t) (i - y0) * (x1 - x0);
+                    const Hit *first = coherent ? &hits[count] : nullptr;
+                    if (!record) {
+                        radiance[k] = tracePath(rays[count], samplers[count], first);
+                        continue;
+                    }
+                    record->ranges[k].first = (int) record->vertices.size();
+                    radiance[k] = tracePath(rays[count], samplers[count], first, &record->vertices);
+                    record->ranges[k].second = (int) record->vertices.size();
+                }
+            }
+        }
+    }
+}
+
+void Scene::traceAdaptive(const Camera &camera, int x0, int y0, int x1, int y1, Vec3r *radiance,
+                          std::atomic<long long> &budget) const {
+    struct PixelEstimate {
+        Vec3r sum = Vec3r(0, 0, 0);
+        Real mean = 0;          // running mean and squared deviations of the luminance
+        Real m2 = 0;
+        int count = 0;
+    };
+
+    int width = camera.getWidth();
+    int height = camera.getHeight();
+    int tile_width = x1 - x0;
+    std::vector<PixelEstimate> estimates((size_t) tile_width * (y1 - y0));
+
+    auto add_samples = [&](int k, int count) {
+        PixelEstimate &estimate = estimates[k];
+        long long i = y0 + k / tile_width;
+        long long j = x0 + k % tile_width;
+        long long pixel = j + i * width;
+        for (int s = 0; s < count; s++) {
+            Sampler sampler(samplerType, pixel, estimate.count);
+            Ray ray = camera.sampleRay(width, height, i, j, sampler, true);
+            STATS_ADD(cameraRays, 1);
+            Vec3r L = fireRay(ray, sampler);
+
+            Real luminance = 0.2126 * L[0] + 0.7152 * L[1] + 0.0722 * L[2];
+            estimate.count++;
+            estimate.sum += L;
+            Real delta = luminance - estimate.mean;
+            estimate.mean += delta / estimate.count;
+            estimate.m2 += delta * (luminance - estimate.mean);
+        }
+    };
 
-    std::vector<cv::Vec3d> allPoint;
-    int counter = 0;
-    cv::Vec3d translation = {400,0,-300};
-    while (getline(file, s)) {
+    for (int k = 0; k < estimates.size(); k++) {
+        add_samples(k, adaptiveBaseSamples);
+    }
 
-        std::istringstream iss(s);
-        std::string vOrF;
-        iss >> vOrF;
-        if (vOrF == "v"){
-            std::vector<double> cords;
-            for (std::string s; iss >> s;)
-                cords.push_back(stod(s) * 85);
-            cv::Vec3d new_point = cv::Vec3d(cords[0], cords[1],
-                                            cords[2]); // Было cv::Vec3d(cords[0], cords[1], cords[2])
-            allPoint.push_back(new_point + translation);
+    // Relative standard error of the mean, or the largest relative contrast with the 4 neighbours in the tile
+    auto needs_samples = [&](int k) {
+        const PixelEstimate &estimate = estimates[k];
+        if (estimate.count >= maxSamples) {
+            return false;
+        }
+        Real scale = std::max(std::abs(estimate.mean), Real(1e-6));
+        Real error = std::sqrt(estimate.m2 / (estimate.count - 1) / estimate.count) / scale;
+        if (error > adaptiveThreshold) {
+            return true;
+        }
+        int i = k / tile_width;
+        int j = k % tile_width;
+        const int neighbours[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+        for (const auto &offset : neighbours) {
+            int ni = i + offset[0];
+            int nj = j + offset[1];
+            if (ni < 0 || ni >= y1 - y0 || nj < 0 || nj >= tile_width) {
+                continue;
+            }
+            Real other = estimates[nj + ni * tile_width].mean;
+            Real contrast = std::abs(estimate.mean - other) / std::max(std::abs(estimate.mean) + std::abs(other), Real(1e-6));
+            if (contrast > adaptiveThreshold) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::vector<int> refine;
+    while (true) {
+        refine.clear();
+        for (int k = 0; k < estimates.size(); k++) {
+            if (needs_samples(k)) {
+                refine.push_back(k);
+            }
+        }
+        if (refine.empty()) {
+            break;
         }
 
-        if (vOrF == "f") {
-            std::vector<int> number_of_triangles;
-            for (std::string s; iss >> s;)
-                number_of_triangles.push_back(stoi(s));
-            cv::Vec3d v0 = allPoint[number_of_triangles[0]-1];
-            cv::Vec3d v1 = allPoint[number_of_triangles[1]-1];
-            cv::Vec3d v2 = allPoint[number_of_triangles[2]-1];
-            this->setNewTriangle(v0, v1, v2, 3);
+        bool exhausted = false;
+        for (int k : refine) {
+            int count = std::min(adaptiveRoundSamples, maxSamples - estimates[k].count);
+            if (rayBudget > 0 && budget.fetch_sub(count) < count) {
+                exhausted = true;
+                break;
+            }
+            add_samples(k, count);
+        }
+        if (exhausted) {
+            break;
         }
     }
-    file.close();
 
-    return exit_code;
+    for (int k = 0; k < estimates.size(); k++) {
+        radiance[k] = estimates[k].sum / estimates[k].count;
+    }
+}
+
+// Antialiasing filter: pixel (i, j) is the mean of the 3x3 samples centred on sample (2i+1, 2j+1)
+static void filterSamples(const std::vector<Vec3r> &samples, int width, int height, std::vector<Vec3r> &pixels) {
+    int stride = 2 * width + 1;
+    pixels.resize((size_t) width * height);
+    for (long long i = 0; i < height; i++) {
+        for (long long j = 0; j < width; j++) {
+            long long position_X = i * 2 + 1;
+            long long position_Y = j * 2 + 1;
+            pixels[j + i * width] = (samples[position_Y - 1 + (position_X - 1) * stride] +
+                                     samples[position_Y +     (position_X - 1) * stride] +
+                                     samples[position_Y + 1 + (position_X - 1) * stride] +
+                                     samples[position_Y - 1 + (position_X) *     stride] +
+                                     samples[position_Y +     (position_X) *     stride] +
+                                     samples[position_Y + 1 + (position_X) *     stride] +
+                                     samples[position_Y - 1 + (position_X + 1) * stride] +
+                                     samples[position_Y +     (position_X + 1) * stride] +
+                                     samples[position_Y + 1 + (position_X + 1) * stride]) / 9;
+        }
+    }
 }
 
+void Scene::relightRegion(const RelightTile &tile, int width, int x0, int y0, int x1, int y1,
+                          Vec3r *radiance) const {
+    for (long long i = y0; i < y1; i++) {
+        for (long long j = x0; j < x1; j++) {
+            const std::pair<int, int> &range = tile.ranges[(j - x0) + (i - y0) * (x1 - x0)];
+            Sampler sampler(samplerType, j + i * width, 0);
+            Vec3r L(0, 0, 0);
+            for (int v = range.first; v < range.second; v++) {
+                const RelightVertex &vertex = tile.vertices[v];
+                sampler.setDimension(vertex.dimension);
+                addLights(vertex.position, vertex.N, materials[vertex.materialId], vertex.L, vertex.weight,
+                          sampler, L);
+            }
+            *radiance++ = L;
+        }
+    }
+}
 
-void Scene::render() {
-    std::cout << triangles.size() << std::endl;
-    for (auto &camera : cameras) {
+const Vec3r *Scene::traceTile(const Camera &camera, int x0, int y0, int x1, int y1, std::vector<Vec3r> &samples,
+                              std::vector<Vec3r> &pixels, std::atomic<long long> &budget, RelightTile *record,
+                              const RelightTile *replay) const {
+    STATS_TIMER(Trace);
+    if (adaptiveSampling && !replay) {
+        // Adaptive sampling is traced tile by tile, also in wavefront mode
+        pixels.resize((size_t) (x1 - x0) * (y1 - y0));
+        traceAdaptive(camera, x0, y0, x1, y1, pixels.data(), budget);
+        return pixels.data();
+    }
+
+    // With antialiasing the tile is sampled on its part of the (2w+1) x (2h+1) grid, see renderTiles
+    int width = camera.getWidth();
+    int height = camera.getHeight();
+    int border = antialiasing ? 1 : 0;
+    int samples_width = antialiasing ? 2 * width + 1 : width;
+    int samples_height = antialiasing ? 2 * height + 1 : height;
+    int sx0 = antialiasing ? 2 * x0 : x0, sx1 = (antialiasing ? 2 * x1 : x1) + border;
+    int sy0 = antialiasing ? 2 * y0 : y0, sy1 = (antialiasing ? 2 * y1 : y1) + border;
+    samples.resize((size_t) (sx1 - sx0) * (sy1 - sy0));
+    if (replay) {
+        relightRegion(*replay, samples_width, sx0, sy0, sx1, sy1, samples.data());
+    } else {
+        traceRegion(camera, samples_width, samples_height, sx0, sy0, sx1, sy1, samples.data(), record);
+    }
+    if (!antialiasing) {
+        return samples.data();
+    }
+    filterSamples(samples, x1 - x0, y1 - y0, pixels);
+    return pixels.data();
+}
+
+void Scene::renderTiles(const std::vector<RenderJob> &jobs) {
+    getPool();
+
+    // With antialiasing the image is sampled on a (2w+1) x (2h+1) grid. The samples of a tile
+    // are its pixels' 3x3 blocks, so neighbouring tiles share a border row or column that both
+    // trace; a sample depends only on its coordinates, so both get the same value.
+    int border = antialiasing ? 1 : 0;
+    auto to_samples = [&](int pixel) {
+        return antialiasing ? 2 * pixel : pixel;
+    };
+
+    // Tiles of all the images are numbered one after another, so workers that finish the tiles of
+    // one image go on with the next instead of waiting for the slowest tile of every image
+    std::vector<const RenderJob *> tiled;
+    std::vector<int> first_tiles(1, 0);
+    for (const auto &job : jobs) {
+        const Camera &camera = *job.camera;
         int width = camera.getWidth();
         int height = camera.getHeight();
-        double fov = camera.getFov();
-        std::vector<Ray> framebuffer(width * height);
-        if (antialiasing) {
-            width = width*2+1;
-            height = height*2+1;
-            std::vector<Ray> antialiasingFrameBuffer(width * height);
-
-            for (long long i = 0; i < height; i++) {
-                for (long long j = 0; j < width; j++) {
-                    double x = -(2 * (j + 0.5) / (double) width - 1) * tan(fov / 2.) * width /
-                               (double) height;
-                    double y = -(2 * (i + 0.5) / (double) height - 1) * tan(fov / 2.);
-                    cv::Vec3d direction = get_normalized(cv::Vec3d(x, y, -1));
-
-                    Ray ray(camera.getPosition(), direction);
-                    antialiasingFrameBuffer[j + i * width] = fireRay(ray);
+        bool adaptive = adaptiveSampling && !job.replay;
+
+        // Recorded paths belong to tiles and the wavefront stages shade RGB only, so wavefront mode
+        // renders through the tiles for those as well
+        if (wavefront && !spectral && !adaptive && !job.record && !job.replay) {
+            // Bands of whole rows, each traced as one wavefront batch
+            int samples_width = antialiasing ? 2 * width + 1 : width;
+            int samples_height = antialiasing ? 2 * height + 1 : height;
+            int rows = std::max(1, wavefrontBatchSize / (samples_width * (antialiasing ? 2 : 1)));
+            std::vector<Vec3r> samples, pixels;
+            for (int y0 = 0; y0 < height; y0 += rows) {
+                int y1 = std::min(y0 + rows, height);
+                int sy0 = to_samples(y0);
+                int sy1 = to_samples(y1) + border;
+                samples.resize((size_t) samples_width * (sy1 - sy0));
+                {
+                    STATS_TIMER(Trace);
+                    renderWavefront(camera, samples_width, samples_height, sy0, sy1, samples.data());
                 }
-            }
-
-            width = (width-1)/2;
-            height = (height-1)/2;
-
-            for (long long i = 0; i < height; i++) {
-                for (long long j = 0; j < width; j++) {
-                    int position_X = i * 2 + 1;
-                    int position_Y = j * 2 + 1;
-                    Ray result = antialiasingFrameBuffer[0].MakeBlackRay();
-                    result.L = (   antialiasingFrameBuffer[position_Y - 1 + (position_X - 1) * (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y +     (position_X - 1) * (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y + 1 + (position_X - 1) * (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y - 1 + (position_X) *     (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y +     (position_X) *     (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y + 1 + (position_X) *     (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y - 1 + (position_X + 1) * (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y +     (position_X + 1) * (width * 2 + 1)].L +
-                                   antialiasingFrameBuffer[position_Y + 1 + (position_X + 1) * (width * 2 + 1)].L) / 9;
-
-                    framebuffer[j + i * width] = result;
+                const std::vector<Vec3r> *band = &samples;
+                if (antialiasing) {
+                    filterSamples(samples, width, y1 - y0, pixels);
+                    band = &pixels;
+                }
+                if (job.writer) {
+                    STATS_TIMER(Write);
+                    job.writer->writeTile(band->data(), width, 0, y0, width, y1);
                 }
             }
+            continue;
+        }
+
+        int tiles = ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+        if (job.record) {
+            job.record->assign(tiles, RelightTile());
+        }
+        tiled.push_back(&job);
+        first_tiles.push_back(first_tiles.back() + tiles);
+    }
 
+    std::vector<std::vector<Vec3r>> samples(pool->getThreadsCount());
+    std::vector<std::vector<Vec3r>> pixels(pool->getThreadsCount());
+    // The ray budget is per image
+    std::unique_ptr<std::atomic<long long>[]> budgets(new std::atomic<long long>[tiled.size()]);
+    for (int j = 0; j < tiled.size(); j++) {
+        budgets[j] = rayBudget;
+    }
 
-        } else {
-            for (long long i = 0; i < height; i++) {
-                for (long long j = 0; j < width; j++) {
-
-                    double x = -(2 * (j + 0.5) / (double) width - 1) * tan(fov / 2.) * width /
-                               (double) height;
-                    double y = -(2 * (i + 0.5) / (double) height - 1) * tan(fov / 2.);
-                    cv::Vec3d direction = get_normalized(cv::Vec3d(x, y, -1));
-                    Ray ray(camera.getPosition(), direction);
-                    framebuffer[j + i * width] = fireRay(ray);
-                }
+    // Every pixel depends only on its own coordinates, so the images do not depend on scheduling
+    pool->parallelFor(first_tiles.back(), [&](int index, int worker) {
+        int j = (int) (std::upper_bound(first_tiles.begin(), first_tiles.end(), index) - first_tiles.begin()) - 1;
+        const RenderJob &job = *tiled[j];
+        int width = job.camera->getWidth();
+        int height = job.camera->getHeight();
+        int tiles_x = (width + tileSize - 1) / tileSize;
+        int tile = index - first_tiles[j];
+        int y0 = (tile / tiles_x) * tileSize;
+        int x0 = (tile % tiles_x) * tileSize;
+        int y1 = std::min(y0 + tileSize, height);
+        int x1 = std::min(x0 + tileSize, width);
+
+        const Vec3r *tile_pixels = traceTile(*job.camera, x0, y0, x1, y1, samples[worker], pixels[worker], budgets[j],
+                                             job.record ? &(*job.record)[tile] : nullptr,
+                                             job.replay ? &(*job.replay)[tile] : nullptr);
+        if (job.writer) {
+            STATS_TIMER(Write);
+            job.writer->writeTile(tile_pixels, x1 - x0, x0, y0, x1, y1);
+        }
+    });
+}
+
+void Scene::render() {
+    {
+        STATS_TIMER(Render);
+        build();
+        size_t triangles_count = triangles.size();
+        for (const auto &instance : instances) {
+            triangles_count += meshes[instance.mesh].indices.size() / 3;
+        }
+        std::cout << triangles_count << std::endl;
+        renderCameras(-1);
+    }
+    writeStats();
+}
+
+void Scene::renderSequence(const int & frames, const std::function<void(Scene &scene, int frame)> &update) {
+    {
+        STATS_TIMER(Render);
+        for (int frame = 0; frame < frames; frame++) {
+            if (update) {
+                update(*this, frame);
             }
+            build();
+            renderCameras(frame);
         }
+    }
+    writeStats();
+}
 
+void Scene::renderCameras(int frame) {
+    relightPaths.clear();
+    bool record = frame < 0 && relightCache && !progressive && !adaptiveSampling && !spectral;
+    if (record) {
+        relightPaths.resize(cameras.size());
+    }
 
+    std::vector<std::unique_ptr<ImageWriter>> writers(cameras.size());
+    std::vector<RenderJob> jobs;
+    for (int c = 0; c < cameras.size(); c++) {
+        const Camera &camera = cameras[c];
+        std::string path = getImagePath(c, frame);
+        writers[c] = createWriter(c, frame);
+        if (progressive) {
+            // One at a time, each with its own preview
+            renderProgressive(camera, writers[c].get());
+            closeWriter(path, writers[c].get());
+            continue;
+        }
+        jobs.push_back({&camera, writers[c].get(), record ? &relightPaths[c] : nullptr, nullptr});
+    }
 
-        // FIXME: Change save path
-        std::ofstream fout("../data/results.txt");
+    if (!jobs.empty()) {
+        renderTiles(jobs);
+        for (int c = 0; c < cameras.size(); c++) {
+            closeWriter(getImagePath(c, frame), writers[c].get());
+        }
+    }
+}
 
-        std::vector<std::string> wavelengths;
-        wavelengths.emplace_back("r");
-        wavelengths.emplace_back("g");
-        wavelengths.emplace_back("b");
+int Scene::relight() {
+    if (cameras.empty() || relightPaths.size() != cameras.size()) {
+        return 1;
+    }
+    {
+        STATS_TIMER(Render);
+        build();        // only the light tree can be out of date
+        std::vector<std::unique_ptr<ImageWriter>> writers(cameras.size());
+        std::vector<RenderJob> jobs;
+        for (int c = 0; c < cameras.size(); c++) {
+            const Camera &camera = cameras[c];
+            writers[c] = createWriter(c, -1);
+            jobs.push_back({&camera, writers[c].get(), nullptr, &relightPaths[c]});
+        }
+        renderTiles(jobs);
+        for (int c = 0; c < cameras.size(); c++) {
+            closeWriter(getImagePath(c, -1), writers[c].get());
+        }
+    }
+    writeStats();
+    return 0;
+}
 
-        for (int k = 0; k < wavelengths.size(); k++) {
-            fout << "wavelength" << " " << wavelengths[k] << std::endl;
-            for (long long i = 0; i < height; i++) {
-                for (long long j = 0; j < width; j++) {
-                    if (j == 0) {
-                        fout << framebuffer[j + i * width].L[k];
-                    } else {
-                        fout << " "
-                             << framebuffer[j + i * width].L[k];
-                    }
-                }
-                fout << std::endl;
-            }
-            fout << "\n";
+std::string Scene::getImagePath(int camera, int frame) const {
+    const std::string &path = cameras[camera].getOutputPath();
+    std::string suffix;
+    for (int c = 0; c < cameras.size(); c++) {
+        if (c != camera && cameras[c].getOutputPath() == path) {
+            suffix = "_" + std::to_string(camera);
+            break;
         }
+    }
+    if (frame >= 0) {
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d", frame);
+        suffix += number;
+    }
 
-        fout.close();
+    // The suffix goes before the extension, which selects the image format
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + suffix;
+    }
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+std::unique_ptr<ImageWriter> Scene::createWriter(int camera, int frame) const {
+    if (cameras[camera].getOutputPath().empty()) {
+        return nullptr;
+    }
+    std::string path = getImagePath(camera, frame);
+    auto writer = ImageWriter::create(path, cameras[camera].getWidth(), cameras[camera].getHeight());
+    if (!writer) {
+        std::cout << "Scene: failed to create " << path << std::endl;
+    }
+    return writer;
+}
+
+void Scene::closeWriter(const std::string &path, ImageWriter *writer) const {
+    STATS_TIMER(Write);
+    if (writer && writer->close() != 0) {
+        std::cout << "Scene: failed to write " << path << std::endl;
+    }
+}
+
+void Scene::writeStats() const {
+    if (statsPath.empty()) {
+        return;
+    }
+    if (writeStatsJson(statsPath, collectStats()) != 0) {
+        std::cout << "Scene: failed to write " << statsPath << std::endl;
     }
 }
\ No newline at end of file
@@ -2,32 +2,111 @@
 #define RENDER_TOOLS_H
 #define _USE_MATH_DEFINES
 
-#include <opencv2/core/matx.hpp>
+#include "Precision.h"
+#include "Sampler.h"
+#include "Spectrum.h"
+#include "Stats.h"
+#include "TriangleKernels.h"
 
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+
+class ThreadPool;
+class ImageWriter;
+class CacheWriter;
+class CacheReader;
 
 //==============================================================================
 //================================ Free functions ==============================
 //==============================================================================
-cv::Vec3d get_normalized(const cv::Vec3d &vec);
-double get_length(const cv::Vec3d &vec);
+Vec3r get_normalized(const Vec3r &vec);
+Real get_length(const Vec3r &vec);
+Vec3r offsetRayOrigin(const Vec3r &point, const Vec3r &N, Real distance);
 
 //==============================================================================
 //================================ Ray =========================================
 //==============================================================================
+// Only the geometry: shadow rays, packets and queues of rays carry no radiance, paths
+// keep their throughput next to the ray
 class Ray {
 public:
     Ray() = default;
-    Ray(cv::Vec3d color);
-    Ray(const cv::Vec3d &origin, const cv::Vec3d &direction);
-    Ray(const cv::Vec3d &new_origin, const cv::Vec3d &new_direction, cv::Vec3d color);
-    Ray MakeBlackRay();
+    Ray(const Vec3r &origin, const Vec3r &direction);
+public:
+    Vec3r origin;
+    Vec3r direction;
+};
+
+//==============================================================================
+//================================ RayPacket ===================================
+//==============================================================================
+// Rays from one origin whose directions share an octant, traced through a BVH together.
+// Each inverse direction component then lies in a range of one sign, which bounds the
+// slab distances of every ray at once, so a box can be culled for the whole packet.
+struct RayPacket {
+public:
+    static constexpr int maxSize = 64;      // an 8x8 block, one bit per ray in a mask
+    // Returns false, leaving the packet unusable, if the rays do not meet the conditions above
+    bool set(const Ray *rays, int count);
+    uint64_t getFullMask() const { return size == maxSize ? ~0ull : (1ull << size) - 1; }
+public:
+    int size = 0;
+    Ray rays[maxSize];
+    Vec3r invDirections[maxSize];
+    Vec3r invMin;
+    Vec3r invMax;
+    bool negative[3] = {false, false, false};
+};
+
+//==============================================================================
+//================================ AABB ========================================
+//==============================================================================
+struct AABB {
+public:
+    AABB();
+    void expand(const Vec3r &point);
+    void expand(const AABB &box);
+    void pad(Real epsilon);
+    Vec3r getCentroid() const;
+    Real getSurfaceArea() const;
+    int getLongestAxis() const;
+    bool intersect(const Ray &ray, const Vec3r &inv_direction, Real t_max, Real &t_near) const;
+    // Conservative interval test: false only if no ray of the packet hits the box before t_max
+    bool intersect(const RayPacket &packet, Real t_max) const;
+public:
+    Vec3r min;
+    Vec3r max;
+};
+
+//==============================================================================
+//================================ Transform ===================================
+//==============================================================================
+// Affine transform stored as the top 3x4 part of a 4x4 matrix
+struct Transform {
+public:
+    Transform();
+    static Transform translate(const Vec3r &offset);
+    static Transform scale(Real factor);
+    static Transform scale(const Vec3r &factors);
+    static Transform rotate(const Vec3r &axis, Real angle);
+
+    Transform operator*(const Transform &other) const;     // applies other first
+    Transform inverse() const;
+    Vec3r applyToPoint(const Vec3r &point) const;
+    Vec3r applyToVector(const Vec3r &vector) const;
+    AABB applyToBounds(const AABB &box) const;
 public:
-    cv::Vec3d origin;
-    cv::Vec3d direction;
-    cv::Vec3d L;
+    Real m[3][4];
 };
 
 //==============================================================================
@@ -36,18 +115,19 @@ public:
 class Material {
 public:
     Material() = default;
-    Material(cv::Vec3d rgb_Kd_color,  cv::Vec3d bright_coefficient);
-    void setBRDF(double newBRDF){
-        BRDF = std::min(newBRDF, 0.99999);
+    Material(Vec3r rgb_Kd_color,  Vec3r bright_coefficient);
+    void setBRDF(Real newBRDF){
+        BRDF = std::min(newBRDF, Real(0.99999));
         if (BRDF < 0) BRDF = 0;
     }
-    double giveBRDF(){ return BRDF;};
-    cv::Vec3d giveRGBCOlod(){return rgb_Kd_color;}
+    Real giveBRDF() const{ return BRDF;};
+    Vec3r giveRGBCOlod() const{return rgb_Kd_color;}
+    Vec3r giveBrightCoefficient() const{return bright_coefficient;}
 
 private:
-    double BRDF = 0.0;
-    cv::Vec3d rgb_Kd_color;
-    cv::Vec3d bright_coefficient;
+    Real BRDF = 0.0;
+    Vec3r rgb_Kd_color;
+    Vec3r bright_coefficient;
 };
 
 //==============================================================================
@@ -58,18 +138,26 @@ class Triangle {
 public:
     Triangle() = default;
 
-    Triangle(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2);
-    Triangle(const cv::Vec3d &v0, const cv::Vec3d &v1, const cv::Vec3d &v2,
+    Triangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2);
+    Triangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
              const Material *material);
-    cv::Vec3d getNormalByObserver(const cv::Vec3d &observer) const;
-    bool intersect(const Ray &ray, double &t) const;
+    Triangle(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2,
+             const Material *material, int materialId);
+    Vec3r getNormalByObserver(const Vec3r &observer) const;
+    bool intersect(const Ray &ray, Real &t) const;
+    AABB getBounds() const;
+    void getVertices(Vec3r &v0, Vec3r &v1, Vec3r &v2) const;
     Material giveMaterial() const{
         return *material;
     }
+    int getMaterialId() const{
+        return materialId;
+    }
 
 private:
-    cv::Vec3d v0, v1, v2;
+    Vec3r v0, v1, v2;
     const Material *material;
+    int materialId = -1;
 };
 
 //==============================================================================
@@ -78,18 +166,18 @@ private:
 struct Light {
 public:
     Light() = default;
-    Light(const cv::Vec3d &new_position);
-    Light(const cv::Vec3d &new_position,
-          cv::Vec3d new_rgb_intensity);
-    cv::Vec3d givePosition(){
+    Light(const Vec3r &new_position);
+    Light(const Vec3r &new_position,
+          Vec3r new_rgb_intensity);
+    Vec3r givePosition() const{
         return position;
     }
-    cv::Vec3d giveRGBIntensity(){
+    Vec3r giveRGBIntensity() const{
         return rgb_intensity;
     }
 private:
-    cv::Vec3d position;
-    cv::Vec3d rgb_intensity;
+    Vec3r position;
+    Vec3r rgb_intensity;
 };
 
 //==============================================================================
@@ -97,21 +185,288 @@ private:
 //==============================================================================
 class Camera {
 public:
-    Camera(int width, int height, double fov, const cv::Vec3d &origin);
+    Camera(int width, int height, Real fov, const Vec3r &origin);
 
     void getPicture();
 
     int getWidth() const;
     int getHeight() const;
-    double getFov() const;
-    cv::Vec3d getPosition() const;
+    Real getFov() const;
+    Vec3r getPosition() const;
+    // The image format follows the extension, see ImageWriter.h. The default is a .nit file,
+    // which takes the tiles as they finish; a .txt path keeps the whole image in memory. An
+    // empty path renders without writing an image.
+    void setOutputPath(const std::string & outputPath);
+    const std::string &getOutputPath() const;
+    // Ray through the centre of cell (i, j) of a width x height grid laid over the image
+    Ray getRay(int width, int height, long long i, long long j) const;
+    // Ray through the point (y, x) of that grid, in cell units from its top left corner, leaving
+    // the lens at (lensU, lensV) of the unit square mapped onto the aperture disk
+    Ray getRayThrough(int width, int height, double y, double x, Real lensU = 0.5, Real lensV = 0.5) const;
+    // Ray through cell (i, j) with the pixel and lens positions taken from the sampler, at the
+    // cell centre unless jitter is set; leaves the sampler at Sampler::pathDimension
+    Ray sampleRay(int width, int height, long long i, long long j, Sampler &sampler, bool jitter) const;
+    // Thin lens: points at focusDistance along the view axis are sharp (0 aperture - pinhole)
+    void setLens(const Real & aperture, const Real & focusDistance);
+    Real getAperture() const;
+    Real getFocusDistance() const;
 
 private:
     const int width = -1;
     const int height = -1;
-    const double fov = -1.0;
+    const Real fov = -1.0;
+
+    const Vec3r origin = {-1.0, -1.0, -1.0};
+    Real aperture = 0;
+    Real focusDistance = 1;
+    std::string outputPath = "../data/results.nit";
+};
+
+//==============================================================================
+//================================ BVH =========================================
+//==============================================================================
+struct BVHNode {
+    AABB bounds;
+    int offset = 0;      // first triangle for leaves, right child for inner nodes
+    int count = 0;       // number of triangles, 0 for inner nodes
+    int axis = 0;
+};
+
+class BVH {
+public:
+    BVH() = default;
+    void build(const std::vector<Triangle> &triangles);
+    void build(const std::vector<Vec3r> &vertices, const std::vector<int> &triangle_indices);
+    // Hierarchy over arbitrary boxes without triangle data, walked with traverse()
+    void build(const std::vector<AABB> &bounds);
+    // Moves the hierarchy with its primitives, which keep their number and order since the build:
+    // the boxes are recomputed bottom-up over the same tree. Returns false once the refitted tree
+    // has become much looser than the built one, when a new build() is worth its cost.
+    bool refit(const std::vector<Triangle> &triangles);
+    bool refit(const std::vector<AABB> &bounds);
+    void clear();
+    bool empty() const { return nodes.empty(); }
+    AABB getBounds() const { return nodes.empty() ? AABB() : nodes[0].bounds; }
+    bool intersect(const Ray &ray, Real &t, int &triangle_index,
+                   Real t_max = std::numeric_limits<Real>::max()) const;
+    bool occluded(const Ray &ray, Real t_max) const;
+    // intersect() for the rays of the mask: t and triangle_index hold each ray's t_max and -1
+    // on entry and its closest hit, if any, on return; the results match intersect() exactly
+    void intersect(const RayPacket &packet, uint64_t mask, Real t[], int triangle_index[]) const;
+    KernelType getKernelType() const { return kernelType; }
+
+    // Calls leaf(primitive, t_max) for the primitives of every leaf the ray enters before t_max.
+    // The callback may shrink t_max and returns true to stop the traversal.
+    template<typename LeafFunction>
+    void traverse(const Ray &ray, Real t_max, LeafFunction &&leaf) const;
+    // The same for a packet: leaf(primitive, mask, t_max) gets the rays of the mask that enter
+    // the leaf before their own t_max, in the order every one of them would visit it alone
+    template<typename LeafFunction>
+    void traverse(const RayPacket &packet, uint64_t mask, Real t_max[], LeafFunction &&leaf) const;
+
+private:
+    friend class Scene;     // the scene cache stores the built hierarchy
+
+    // Packet traversal behind traverse() and intersect(): leaf(node, hits) is called for every
+    // leaf node with the mask of the rays that enter it before their own t_max
+    template<typename NodeFunction>
+    void traverseNodes(const RayPacket &packet, uint64_t mask, Real t_max[], NodeFunction &&leaf) const;
+    void buildNodes(const std::vector<AABB> &bounds);
+    bool refitNodes(const std::vector<AABB> &bounds);
+    // Sum of the node surface areas over the root's, the expected node visits of a ray
+    Real getCost() const;
+    int buildRecursive(const std::vector<AABB> &bounds, const std::vector<Vec3r> &centroids,
+                       int begin, int end, int depth);
+
+private:
+    static constexpr int maxLeafSize = TriangleSoA::maxBatchSize;
+    static constexpr int binsCount = 16;
+    static constexpr int maxSahDepth = 64;       // deeper nodes are median split, bounding the stack
+    static constexpr int maxStackSize = 128;
+    static constexpr Real maxRefitGrowth = 1.5;     // refits allowed until the cost grows by half
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices;
+    TriangleSoA soa;                   // triangles in the order of indices
+    Real buildCost = 0;                // getCost() after the last build, 0 when unknown
+    KernelType kernelType = detectKernelType();
+    TriangleKernel kernel = getTriangleKernel(kernelType);
+};
+
+template<typename LeafFunction>
+void BVH::traverse(const Ray &ray, Real t_max, LeafFunction &&leaf) const {
+    if (nodes.empty()) {
+        return;
+    }
+
+    Vec3r inv_direction;
+    for (int i = 0; i < 3; i++) {
+        Real d = ray.direction[i];
+        inv_direction[i] = 1 / (d != 0 ? d : std::numeric_limits<Real>::min());
+    }
+
+    int stack[maxStackSize];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    long long visits = 0;
+
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode &node = nodes[node_index];
+        visits++;
+        Real t_near;
+        if (!node.bounds.intersect(ray, inv_direction, t_max, t_near)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                if (leaf(indices[i], t_max)) {
+                    STATS_ADD(nodeVisits, visits);
+                    return;
+                }
+            }
+        } else {
+            int left = node_index + 1;
+            int right = node.offset;
+            if (ray.direction[node.axis] < 0) {
+                std::swap(left, right);
+            }
+            stack[stack_size++] = right;
+            stack[stack_size++] = left;
+        }
+    }
+    STATS_ADD(nodeVisits, visits);
+}
+
+template<typename LeafFunction>
+void BVH::traverse(const RayPacket &packet, uint64_t mask, Real t_max[], LeafFunction &&leaf) const {
+    traverseNodes(packet, mask, t_max, [&](const BVHNode &node, uint64_t hits) {
+        for (int i = node.offset; i < node.offset + node.count; i++) {
+            leaf(indices[i], hits, t_max);
+        }
+    });
+}
+
+template<typename NodeFunction>
+void BVH::traverseNodes(const RayPacket &packet, uint64_t mask, Real t_max[], NodeFunction &&leaf) const {
+    if (nodes.empty() || mask == 0) {
+        return;
+    }
+
+    // Bounds the distances of the packet; t_max only shrinks, so refreshing it after the leaves is enough
+    auto get_packet_t_max = [&]() {
+        Real result = 0;
+        for (uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+            result = std::max(result, t_max[__builtin_ctzll(rest)]);
+        }
+        return result;
+    };
+    Real packet_t_max = get_packet_t_max();
+
+    int stack[maxStackSize];
+    uint64_t masks[maxStackSize];
+    int stack_size = 0;
+    stack[stack_size] = 0;
+    masks[stack_size++] = mask;
+    long long visits = 0;       // a node tested for the whole packet counts once
 
-    const cv::Vec3d origin = {-1.0, -1.0, -1.0};
+    while (stack_size > 0) {
+        --stack_size;
+        int node_index = stack[stack_size];
+        uint64_t active = masks[stack_size];
+        const BVHNode &node = nodes[node_index];
+        visits++;
+        if (!node.bounds.intersect(packet, packet_t_max)) {
+            continue;
+        }
+
+        Real t_near;
+        if (node.count > 0) {
+            // Leaves test every ray, so each one sees exactly the leaves it would visit alone
+            uint64_t hits = 0;
+            for (; active != 0; active &= active - 1) {
+                int k = __builtin_ctzll(active);
+                if (node.bounds.intersect(packet.rays[k], packet.invDirections[k], t_max[k], t_near)) {
+                    hits |= 1ull << k;
+                }
+            }
+            if (hits == 0) {
+                continue;
+            }
+            leaf(node, hits);
+            packet_t_max = get_packet_t_max();
+        } else {
+            // Inner nodes only look for the first ray that enters them, the rest stay active
+            while (active != 0) {
+                int k = __builtin_ctzll(active);
+                if (node.bounds.intersect(packet.rays[k], packet.invDirections[k], t_max[k], t_near)) {
+                    break;
+                }
+                active &= active - 1;
+            }
+            if (active == 0) {
+                continue;
+            }
+            int left = node_index + 1;
+            int right = node.offset;
+            if (packet.negative[node.axis]) {
+                std::swap(left, right);
+            }
+            stack[stack_size] = right;
+            masks[stack_size++] = active;
+            stack[stack_size] = left;
+            masks[stack_size++] = active;
+        }
+    }
+    STATS_ADD(nodeVisits, visits);
+}
+
+//==============================================================================
+//================================ Mesh ========================================
+//==============================================================================
+// Geometry shared by every instance that references it, in object space
+struct Mesh {
+    std::vector<Vec3r> vertices;
+    std::vector<int> indices;       // three per triangle
+    BVH bvh;
+    bool dirty = true;
+};
+
+struct Instance {
+    int mesh = -1;
+    int materialId = -1;
+    Transform objectToWorld;
+    Transform worldToObject;
+};
+
+//==============================================================================
+//================================ LightTree ===================================
+//==============================================================================
+struct LightTreeNode {
+    AABB bounds;
+    Real power = 0;
+    int right = -1;     // right child for inner nodes, the left one follows the node
+    int light = -1;     // light index for leaves, -1 for inner nodes
+};
+
+// Binary hierarchy over point lights. Sampling walks from the root and picks a child
+// with probability proportional to its power over the squared distance to its bounds,
+// so a light is drawn in O(log N) with a pdf that is never zero for a light with power.
+class LightTree {
+public:
+    LightTree() = default;
+    void build(const std::vector<Light> &lights);
+    bool empty() const { return nodes.empty(); }
+    int sample(const Vec3r &point, Real u, Real &pdf) const;
+
+private:
+    friend class Scene;     // the scene cache stores the built tree
+
+    int buildRecursive(const std::vector<Light> &lights, std::vector<int> &order, int begin, int end);
+    Real importance(const LightTreeNode &node, const Vec3r &point) const;
+
+private:
+    std::vector<LightTreeNode> nodes;
 };
 
 //==============================================================================
@@ -120,34 +475,284 @@ private:
 class Scene {
 public:
     Scene();
+    ~Scene();
+    void build();
+    // Renders every camera, the tiles of all of them in one parallel batch. Cameras that share an
+    // output path write to it with their index before the extension (results_1.txt).
     void render();
-    Ray fireRay(Ray &ray);
+    // Renders frames [0, frames) of an animation: update(scene, frame), if set, moves triangles,
+    // instances, lights or cameras before each frame, then the hierarchies are refitted and every
+    // camera rendered as by render(). Frame numbers go before the extension (results_0003.txt).
+    // The relight cache records nothing here.
+    void renderSequence(const int & frames, const std::function<void(Scene &scene, int frame)> &update);
+    // Radiance along the ray; the random decisions of the path come from the sampler,
+    // starting at its current dimension. The seed overload uses sample 0 of pixel seed.
+    Vec3r fireRay(Ray &ray, Sampler &sampler) const;
+    Vec3r fireRay(Ray &ray, unsigned int seed = 0) const;
     int loadCornellBox(const std::string &path_to_file);
     int loadTeapot(const std::string &path_to_file);
+    // Ground, sky, boxes, mirrors and one light: the scene of main.cpp
+    void loadDefaultScene();
+    // Geometry of a Lumicept .shp file; each brep takes the material registered under its name
+    int loadBreps(const std::string &path_to_file);
 
-    void addPlane(const cv::Vec3d& v0,const cv::Vec3d& v1,const cv::Vec3d& v2,
-                  const cv::Vec3d& v4, const int & id);
-    void addCube(const cv::Vec3d& v0, const cv::Vec3d& v1, const cv::Vec3d& v2,
-                 const cv::Vec3d& v3, const int & id, const double& depth);
-    void setNewTriangle(const cv::Vec3d& v0,const cv::Vec3d& v1,const cv::Vec3d& v2,
+    // Both return the index of their first triangle, 2 triangles for a plane and 12 for a cube
+    int addPlane(const Vec3r& v0,const Vec3r& v1,const Vec3r& v2,
+                 const Vec3r& v4, const int & id);
+    int addCube(const Vec3r& v0, const Vec3r& v1, const Vec3r& v2,
+                const Vec3r& v3, const int & id, const Real& depth);
+    void setNewTriangle(const Vec3r& v0,const Vec3r& v1,const Vec3r& v2,
                         const int & id);
 
+    int addMesh(const std::vector<Vec3r> &vertices, const std::vector<int> &indices);
+    int loadMesh(const std::string &path_to_file, int &mesh_id);
+    int addInstance(const int & mesh_id, const Transform &transform, const int & id);
+    // Animation: triangles [first, first + count) are moved by transform and instance id is placed
+    // anew. The next build refits the hierarchies over the moved boxes instead of rebuilding them,
+    // until refitting has loosened them too much.
+    void transformTriangles(const int & first, const int & count, const Transform &transform);
+    void setInstanceTransform(const int & id, const Transform &transform);
+
     void setNewCamera(const Camera &camera);
+    // Replaces camera id, e.g. to change its output path
+    void setCamera(const int & id, const Camera &camera);
     void setNewMaterial(const Material& material);
+    void setMaterialName(const std::string & name, const int & id);
     void setNewLight(const Light & light);
+    // Replaces light id, e.g. to move it or to change its intensity
+    void setLight(const int & id, const Light & light);
 
     void setAntialiasing(const bool & antialiasing);
     void setLightInShadows(const bool & lightInShadows);
+    void setBruteForce(const bool & bruteForce);
+    void setMaxDepth(const int & maxDepth);
+    void setThreadsCount(const int & threadsCount);
+    void setWavefront(const bool & wavefront);
+    void setLightSamples(const int & lightSamples);
+    void setSampler(const SamplerType & samplerType);
+    // Camera rays through the pixel centres are intersected in packets of 8x8; a block that
+    // straddles a direction octant, or uses a lens, is traced ray by ray. The image is the same.
+    void setPacketTracing(const bool & packetTracing);
+    // With the relight cache on, render() keeps the surface points of every camera path (position,
+    // normal, material and throughput) and relight() writes the images again redoing only the
+    // light loop and its shadow rays, for the current lights. The result is that of a full render
+    // as long as the number of lights sampled per hit stays the same. Paths are recorded by the
+    // tile renderer only, wavefront mode renders through it while the cache is on, adaptive and
+    // progressive renders record nothing. relight() returns 0 on success and 1 when there is
+    // nothing to relight, also after geometry, materials, cameras or sampling settings changed.
+    void setRelightCache(const bool & relightCache);
+    int relight();
+    // Adaptive sampling replaces the antialiasing grid: every pixel starts with a few jittered
+    // samples and gets more while its relative noise or its contrast with the neighbouring
+    // pixels is above the threshold, up to maxSamples per pixel. rayBudget caps the extra
+    // samples of a whole image (0 - no limit); once it runs out the image depends on scheduling.
+    void setAdaptiveSampling(const bool & adaptiveSampling);
+    void setAdaptiveThreshold(const Real & adaptiveThreshold);
+    void setMaxSamples(const int & maxSamples);
+    void setRayBudget(const long long & rayBudget);
+    // Progressive mode refines the whole image one sample per pixel per pass, showing it in a
+    // preview window, until timeBudget seconds have passed, the mean relative error drops to
+    // convergenceTarget, maxPasses passes are done or Esc is pressed (0 - no such limit).
+    // It ignores the antialiasing, adaptive and wavefront settings. The preview needs a build
+    // with OpenCV; without it there is no window, as with setPreview(false). setProgressReport(true)
+    // prints the passes, time and relative error when it stops.
+    void setProgressive(const bool & progressive);
+    void setPreview(const bool & preview);
+    void setProgressReport(const bool & progressReport);
+    void setTimeBudget(const double & timeBudget);
+    void setConvergenceTarget(const Real & convergenceTarget);
+    void setMaxPasses(const int & maxPasses);
+
+    // Binary snapshot of the built scene, see SceneCache.h. loadCache returns 0 on success,
+    // 1 if the file cannot be read, 2 for another format version or precision, 3 when it
+    // was made from other sources and 4 if it is damaged; the scene is unchanged on failure.
+    int saveCache(const std::string &path_to_file, uint64_t source_hash);
+    int loadCache(const std::string &path_to_file, uint64_t source_hash);
+
+    // With a path set, render() and relight() write the statistics collected since the last
+    // resetStats() there as JSON when they finish (see Stats.h). Counters and timers are only
+    // compiled in with PATH_TRACING_STATS; without it the file has zeros and "enabled": false.
+    void setStatsPath(const std::string & statsPath);
+
+    // Spectral mode traces every path at spectralLanes wavelengths at once (see Spectrum.h): a hero
+    // wavelength drawn per path and the others evenly spaced after it, wrapping around the range.
+    // Reflectances and light intensities (per nm) are sampled curves; a material or light without
+    // one takes the band steps of its RGB values. loadCornellBox sets the measured curves of the scene.
+    // Surfaces reflect every wavelength the same way, so the lanes share the path and its rays, and
+    // the lanes are integrated against the CIE matching functions into RGB of the .nit primaries, so
+    // the image is colorimetric rather than that of RGB mode. Wavefront mode renders through the
+    // tiles, and the relight cache records nothing.
+    void setSpectral(const bool & spectral);
+    void setMaterialSpectrum(const int & id, const Spectrum & reflectance);
+    void setLightSpectrum(const int & id, const Spectrum & intensity);
+
+    // Distributed rendering: renderDistributed listens on address, "unix:<path>" or "<host>:<port>"
+    // (no host - every interface), and hands the tiles of every camera to the worker processes that
+    // connect there, which run runWorker with the same scene and settings. A tile still unanswered
+    // after tileTimeout seconds is also given to an idle worker, and the tiles of a worker that
+    // disconnects go to the others; the images are those of render() without wavefront mode, which
+    // the workers do not use. Both return 0 on success, 1 if the socket cannot be opened and, for a
+    // worker, 2 when the coordinator rejects its scene or breaks off the connection. Workers retry
+    // the connection for a few seconds, so they may start first. The relight cache records nothing.
+    int renderDistributed(const std::string & address);
+    int runWorker(const std::string & address);
+    void setTileTimeout(const double & tileTimeout);
 private:
-    bool intersect(const Ray &ray, cv::Vec3d &positionOfHit, cv::Vec3d &N, Material &material);
+    // Direct light from one light: the result depends on a shadow ray only when test is set
+    struct LightSample {
+        Vec3r lit;
+        Vec3r shadowed;
+        Ray shadowRay;
+        Real distance = 0;
+        bool test = false;
+    };
+
+    // A surface point of a camera path with the inputs of fireRay's light loop there
+    struct RelightVertex {
+        Vec3r position;
+        Vec3r N;
+        Vec3r L;                    // throughput of the path
+        Real weight = 0;
+        int materialId = -1;
+        uint32_t dimension = 0;     // sampler dimension of the first light choice
+    };
+
+    // Paths of the samples of one tile, row by row: sample k owns vertices [ranges[k].first, ranges[k].second)
+    struct RelightTile {
+        std::vector<std::pair<int, int>> ranges;
+        std::vector<RelightVertex> vertices;
+    };
+
+    // Closest intersection: a scene triangle when instance < 0, else a triangle of the instance's mesh
+    struct Hit {
+        Real t = 0;
+        int triangle = -1;
+        int instance = -1;
+    };
+
+    // False for brute force and while build() has changes to apply, then every triangle is tested
+    bool useHierarchies() const;
+    bool closestHit(const Ray &ray, Hit &hit) const;
+    // The same for every ray of the packet, with identical results
+    void closestHit(const RayPacket &packet, Hit hits[]) const;
+    // fireRay, taking the first hit from first when it is set and appending the path's surface
+    // points to record when that is set
+    Vec3r tracePath(Ray &ray, Sampler &sampler, const Hit *first,
+                    std::vector<RelightVertex> *record = nullptr) const;
+    // fireRay's light loop at one surface point, added to radiance light by light
+    void addLights(const Vec3r &point, const Vec3r &N, const Material &material, const Vec3r &L, Real weight,
+                   Sampler &sampler, Vec3r &radiance) const;
+    void getHitSurface(const Ray &ray, const Hit &hit, Vec3r &positionOfHit, Vec3r &N, Material &material) const;
+    int getHitMaterialId(const Hit &hit) const;
+    bool intersect(const Ray &ray, Vec3r &positionOfHit, Vec3r &N, Material &material) const;
+    bool occluded(const Ray &ray, Real t_max) const;
+    void sampleLight(const Light &light, const Vec3r &hitRayIntersection, const Vec3r &N,
+                     const Material &material, const Vec3r &L, LightSample &sample) const;
+    int getLightsPerHit() const;
+    int chooseLight(int sample, const Vec3r &point, Sampler &sampler, Real &scale) const;
+    Vec3r lightContribution(const Light &light, const Vec3r &hitRayIntersection, const Vec3r &N,
+                            const Material &material, const Vec3r &L) const;
+    // tracePath in spectral mode, the lanes integrated to XYZ and converted to RGB
+    Vec3r traceSpectral(const Ray &ray, Sampler &sampler, const Hit *first) const;
+    SpectralSample getReflectance(int materialId, const SpectralSample &wavelengths) const;
+    // lightContribution at the wavelengths, reflected being the reflectance times the throughput
+    SpectralSample spectralLightContribution(int light, const Vec3r &point, const Vec3r &N, const Material &material,
+                                             const SpectralSample &reflected,
+                                             const SpectralSample &wavelengths) const;
+    static void writeBVH(CacheWriter &writer, const BVH &bvh);
+    // False when the hierarchy is damaged: its nodes, leaves or indices are out of range for
+    // primitives triangles or boxes
+    static bool readBVH(CacheReader &reader, BVH &bvh, size_t primitives);
+
+    ThreadPool &getPool();
+    // Tiles are traced, filtered and passed to the writer, if any, one at a time, so memory
+    // does not grow with the image: only the tiles in flight on the workers are kept.
+    // With record set the paths of every tile are kept there, indexed by tile; with replay set
+    // the tiles are shaded from those paths instead of being traced.
+    struct RenderJob {
+        const Camera *camera = nullptr;
+        ImageWriter *writer = nullptr;
+        std::vector<RelightTile> *record = nullptr;
+        const std::vector<RelightTile> *replay = nullptr;
+    };
+    void renderTiles(const std::vector<RenderJob> &jobs);
+    // Pixels [x0, x1) x [y0, y1) of the camera's image, in samples or pixels, whichever is returned;
+    // both are scratch space that grows as needed. budget is traceAdaptive's.
+    const Vec3r *traceTile(const Camera &camera, int x0, int y0, int x1, int y1, std::vector<Vec3r> &samples,
+                           std::vector<Vec3r> &pixels, std::atomic<long long> &budget,
+                           RelightTile *record = nullptr, const RelightTile *replay = nullptr) const;
+    // Every camera to its output, the paths of frame appended unless it is negative
+    void renderCameras(int frame);
+    std::string getImagePath(int camera, int frame) const;
+    // Writer of getImagePath(camera, frame); nullptr for a camera without an output path, and
+    // after reporting it when the file cannot be created
+    std::unique_ptr<ImageWriter> createWriter(int camera, int frame) const;
+    // Radiance of the samples [x0, x1) x [y0, y1) of a width x height grid over the image, row by row
+    void traceRegion(const Camera &camera, int width, int height, int x0, int y0, int x1, int y1,
+                     Vec3r *radiance, RelightTile *record = nullptr) const;
+    // traceRegion from the recorded paths of the region, with the current lights
+    void relightRegion(const RelightTile &tile, int width, int x0, int y0, int x1, int y1, Vec3r *radiance) const;
+    // Adaptive estimate of the pixels [x0, x1) x [y0, y1); budget holds the extra samples left
+    void traceAdaptive(const Camera &camera, int x0, int y0, int x1, int y1, Vec3r *radiance,
+                       std::atomic<long long> &budget) const;
+    // The same for the full-width rows [y0, y1), traced in wavefront order
+    void renderWavefront(const Camera &camera, int width, int height, int y0, int y1, Vec3r *radiance);
+    // Progressive passes over the whole image, which is passed to the writer at the end
+    void renderProgressive(const Camera &camera, ImageWriter *writer);
+    void closeWriter(const std::string &path, ImageWriter *writer) const;
+    void writeStats() const;
+    // Hash of the geometry, lights, cameras and sampling settings, which workers must share
+    uint64_t getFingerprint() const;
 
 private:
     bool antialiasing = false;
     bool lightInShadows = false;
+    bool bruteForce = false;
+    bool wavefront = false;
+    bool adaptiveSampling = false;
+    bool packetTracing = true;
+    bool relightCache = false;
+    bool progressive = false;
+    bool preview = true;
+    bool progressReport = false;
+    bool spectral = false;
+    bool bvhDirty = true;
+    bool instancesDirty = true;
+    bool bvhRefit = false;
+    bool instancesRefit = false;
+    bool lightsDirty = true;
+    int lightSamples = 0;
+    SamplerType samplerType = SamplerType::Sobol;
+    int maxDepth = 16;
+    static constexpr Real rouletteThreshold = 0.01;
+    Real adaptiveThreshold = 0.02;
+    int maxSamples = 64;
+    long long rayBudget = 0;
+    static constexpr int adaptiveBaseSamples = 4;      // one 2x2 stratum each with Sobol
+    static constexpr int adaptiveRoundSamples = 4;
+    double timeBudget = 0;
+    Real convergenceTarget = 0;
+    int maxPasses = 64;
+    double tileTimeout = 30;
+    int threadsCount = 0;
+    static constexpr int tileSize = 16;
+    static constexpr int packetSide = 8;        // packetSide^2 = RayPacket::maxSize
+    static constexpr int wavefrontBatchSize = 1 << 16;
+    std::unique_ptr<ThreadPool> pool;
+    BVH bvh;
+    BVH instancesBvh;
+    LightTree lightTree;
     std::vector<Triangle> triangles;
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
     std::vector<Light> lights;
     std::vector<Material> materials;
+    std::vector<Spectrum> materialSpectra;      // by material id, empty - from the RGB color
+    std::vector<Spectrum> lightSpectra;         // by light, empty - from the RGB intensity
+    std::map<std::string, int> materialIds;
     std::vector<Camera> cameras;
+    std::vector<std::vector<RelightTile>> relightPaths;     // per camera, empty when stale
+    std::string statsPath;
 };
 
 #endif //RENDER_TOOLS_H
\ No newline at end of file
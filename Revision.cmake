@@ -0,0 +1,19 @@
+# Writes the git revision of SOURCE_DIR to OUTPUT as PATH_TRACING_REVISION. Run with
+# cmake -P on every build; the header is only rewritten when the revision changes, so
+# an unchanged revision does not recompile anything.
+execute_process(COMMAND git rev-parse --short HEAD
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_VARIABLE REVISION
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        ERROR_QUIET)
+if (NOT REVISION)
+    set(REVISION unknown)
+endif()
+
+set(CONTENT "#define PATH_TRACING_REVISION \"${REVISION}\"\n")
+if (EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD_CONTENT)
+endif()
+if (NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+    file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
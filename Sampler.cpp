@@ -0,0 +1,103 @@
+#include "Sampler.h"
+
+//==============================================================================
+//================================ Sampler =====================================
+//==============================================================================
+// The Sobol sampler pads any number of dimensions with the 2D (0, 2)-sequence: each
+// dimension or pair shuffles the sample index and scrambles the point with its own
+// hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling", 2020).
+namespace {
+
+constexpr uint64_t pcgMultiplier = 6364136223846793005ull;
+constexpr uint64_t pcgIncrement = 1442695040888963407ull;
+
+Real toUnit(uint32_t x) {
+#ifdef PATH_TRACING_SINGLE_PRECISION
+    return (Real) (x >> 8) * 0x1p-24f;      // 24 bits, so rounding never reaches 1
+#else
+    return (Real) x * 0x1p-32;
+#endif
+}
+
+uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Laine-Karras permutation: every bit depends only on itself and the lower bits
+uint32_t laineKarras(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a base-2 fraction, i.e. of the reversed bits
+uint32_t scramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarras(reverseBits(x), seed));
+}
+
+// The first two Sobol dimensions, as 32-bit fractions
+uint32_t sobol0(uint32_t index) {
+    return reverseBits(index);
+}
+
+uint32_t sobol1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+}
+
+uint32_t hashCounter(uint64_t pixel, uint32_t sample, uint32_t dimension) {
+    uint64_t state = ((((uint64_t) sample << 32) | dimension) * pcgMultiplier + pcgIncrement);
+    state = (state ^ pixel) * pcgMultiplier + pcgIncrement;
+    // RXS M XS output permutation of PCG
+    uint64_t word = ((state >> ((state >> 59u) + 5u)) ^ state) * 12605985483714917081ull;
+    word = (word >> 43u) ^ word;
+    return (uint32_t) (word ^ (word >> 32));
+}
+
+Sampler::Sampler(SamplerType type, uint64_t pixel, uint32_t sample, uint32_t dimension)
+        : type(type), pixel(pixel), sample(sample), dimension(dimension) {
+}
+
+uint32_t Sampler::getSeed(uint32_t salt) const {
+    // The sample index is left out: all samples of a pixel share the scrambling of a dimension
+    return hashCounter(~pixel, salt, dimension);
+}
+
+Real Sampler::get1D() {
+    Real value;
+    if (type == SamplerType::Random) {
+        value = toUnit(hashCounter(pixel, sample, dimension));
+    } else {
+        uint32_t index = scramble(sample, getSeed(0));
+        value = toUnit(scramble(sobol0(index), getSeed(1)));
+    }
+    dimension++;
+    return value;
+}
+
+void Sampler::get2D(Real &u, Real &v) {
+    if (type == SamplerType::Random) {
+        u = toUnit(hashCounter(pixel, sample, dimension));
+        v = toUnit(hashCounter(pixel, sample, dimension + 1));
+    } else {
+        uint32_t index = scramble(sample, getSeed(0));
+        u = toUnit(scramble(sobol0(index), getSeed(1)));
+        v = toUnit(scramble(sobol1(index), getSeed(2)));
+    }
+    dimension += 2;
+}
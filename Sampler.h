@@ -0,0 +1,49 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "Precision.h"
+
+#include <cstdint>
+
+//==============================================================================
+//================================ Sampler =====================================
+//==============================================================================
+// Sample values are pure functions of (pixel, sample index, dimension), with no
+// generator state carried between them, so a path gets the same numbers on any
+// thread and in any order. Dimensions are used in a fixed layout: the pixel
+// position, the lens position, then per bounce the light choices and the Russian
+// roulette decision.
+enum class SamplerType {
+    Random,     // independent uniform values from a counter-based hash
+    Sobol       // Owen-scrambled Sobol points, stratified over the samples of a pixel
+};
+
+class Sampler {
+public:
+    static constexpr uint32_t pixelDimension = 0;
+    static constexpr uint32_t lensDimension = 2;
+    static constexpr uint32_t pathDimension = 4;
+
+    Sampler() = default;
+    Sampler(SamplerType type, uint64_t pixel, uint32_t sample, uint32_t dimension = 0);
+
+    // Values in [0, 1); a pair comes from one 2D point, which is stratified in both axes at once
+    Real get1D();
+    void get2D(Real &u, Real &v);
+
+    uint32_t getDimension() const { return dimension; }
+    void setDimension(uint32_t dimension) { this->dimension = dimension; }
+
+private:
+    uint32_t getSeed(uint32_t salt) const;
+
+    SamplerType type = SamplerType::Sobol;
+    uint64_t pixel = 0;
+    uint32_t sample = 0;
+    uint32_t dimension = 0;
+};
+
+// PCG output permutation of the key (pixel, sample, dimension): a counter-based random integer
+uint32_t hashCounter(uint64_t pixel, uint32_t sample, uint32_t dimension);
+
+#endif //SAMPLER_H
@@ -0,0 +1,519 @@
+#include "SceneCache.h"
+#include "MappedFile.h"
+#include "RenderTools.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+//==============================================================================
+//================================ SceneCache ==================================
+//==============================================================================
+class CacheWriter {
+public:
+    explicit CacheWriter(const std::string &path_to_file) : file(path_to_file, std::ios::binary) {}
+
+    bool good() const { return file.good(); }
+
+    template<typename T>
+    void value(const T &value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "plain values only");
+        file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    void array(const std::vector<T> &values) {
+        static_assert(std::is_arithmetic<T>::value, "plain values only");
+        value((uint64_t) values.size());
+        file.write(reinterpret_cast<const char *>(values.data()), (std::streamsize) (values.size() * sizeof(T)));
+    }
+
+    void vector(const Vec3r &vector) {
+        for (int i = 0; i < 3; i++) {
+            value(vector[i]);
+        }
+    }
+
+    void string(const std::string &string) {
+        value((uint64_t) string.size());
+        file.write(string.data(), (std::streamsize) string.size());
+    }
+
+private:
+    std::ofstream file;
+};
+
+// Reads from the mapped file; after the first overrun every read fails
+class CacheReader {
+public:
+    CacheReader(const char *begin, size_t size) : p(begin), end(begin + size) {}
+
+    bool good() const { return ok; }
+
+    template<typename T>
+    T value() {
+        T value{};
+        if (take(sizeof(T))) {
+            std::memcpy(&value, p - sizeof(T), sizeof(T));
+        }
+        return value;
+    }
+
+    template<typename T>
+    void array(std::vector<T> &values) {
+        uint64_t count = value<uint64_t>();
+        if (!ok || count > (uint64_t) (end - p) / sizeof(T)) {
+            ok = false;
+            return;
+        }
+        values.resize(count);
+        take(count * sizeof(T));
+        if (count > 0) {
+            std::memcpy(values.data(), p - count * sizeof(T), count * sizeof(T));
+        }
+    }
+
+    Vec3r vector() {
+        Vec3r vector;
+        for (int i = 0; i < 3; i++) {
+            vector[i] = value<Real>();
+        }
+        return vector;
+    }
+
+    std::string string() {
+        uint64_t size = value<uint64_t>();
+        if (!ok || size > (uint64_t) (end - p)) {
+            ok = false;
+            return std::string();
+        }
+        take(size);
+        return std::string(p - size, size);
+    }
+
+    // Element counts are checked against the bytes left so a damaged file cannot trigger huge allocations
+    uint64_t count(size_t min_element_size) {
+        uint64_t count = value<uint64_t>();
+        if (!ok || count > (uint64_t) (end - p) / min_element_size) {
+            ok = false;
+            return 0;
+        }
+        return count;
+    }
+
+private:
+    bool take(size_t size) {
+        if (!ok || size > (size_t) (end - p)) {
+            ok = false;
+            return false;
+        }
+        p += size;
+        return true;
+    }
+
+private:
+    const char *p;
+    const char *end;
+    bool ok = true;
+};
+
+namespace {
+
+constexpr char cacheMagic[4] = {'P', 'T', 'S', 'C'};
+
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void writeBounds(CacheWriter &writer, const AABB &box) {
+    writer.vector(box.min);
+    writer.vector(box.max);
+}
+
+AABB readBounds(CacheReader &reader) {
+    AABB box;
+    box.min = reader.vector();
+    box.max = reader.vector();
+    return box;
+}
+
+void writeTransform(CacheWriter &writer, const Transform &transform) {
+    for (const auto &row : transform.m) {
+        for (Real value : row) {
+            writer.value(value);
+        }
+    }
+}
+
+Transform readTransform(CacheReader &reader) {
+    Transform transform;
+    for (auto &row : transform.m) {
+        for (Real &value : row) {
+            value = reader.value<Real>();
+        }
+    }
+    return transform;
+}
+
+void writeSpectra(CacheWriter &writer, const std::vector<Spectrum> &spectra) {
+    writer.value((uint64_t) spectra.size());
+    for (const auto &spectrum : spectra) {
+        writer.array(spectrum.getWavelengths());
+        writer.array(spectrum.getValues());
+    }
+}
+
+void readSpectra(CacheReader &reader, std::vector<Spectrum> &spectra) {
+    spectra.resize(reader.count(sizeof(uint64_t) * 2));
+    for (auto &spectrum : spectra) {
+        std::vector<Real> wavelengths, values;
+        reader.array(wavelengths);
+        reader.array(values);
+        spectrum = Spectrum(std::move(wavelengths), std::move(values));
+    }
+}
+
+}
+
+int hashFiles(const std::vector<std::string> &paths, uint64_t &hash) {
+    uint64_t result = 14695981039346656037ull;
+    for (const auto &path : paths) {
+        MappedFile file;
+        if (file.open(path) != 0) {
+            return 1;
+        }
+        result = fnv1a(file.data(), file.size(), result);
+        // The separator keeps ("ab", "c") and ("a", "bc") apart
+        result = fnv1a("\0", 1, result);
+    }
+    hash = result;
+    return 0;
+}
+
+void Scene::writeBVH(CacheWriter &writer, const BVH &bvh) {
+    writer.value((uint64_t) bvh.nodes.size());
+    for (const auto &node : bvh.nodes) {
+        writeBounds(writer, node.bounds);
+        writer.value(node.offset);
+        writer.value(node.count);
+        writer.value(node.axis);
+    }
+    writer.array(bvh.indices);
+    writer.value((uint64_t) bvh.soa.size());
+    for (auto *array : {&bvh.soa.v0x, &bvh.soa.v0y, &bvh.soa.v0z, &bvh.soa.e1x, &bvh.soa.e1y, &bvh.soa.e1z,
+                        &bvh.soa.e2x, &bvh.soa.e2y, &bvh.soa.e2z}) {
+        writer.array(*array);
+    }
+}
+
+bool Scene::readBVH(CacheReader &reader, BVH &bvh, size_t primitives) {
+    bvh.clear();
+    bvh.nodes.resize(reader.count(sizeof(Real) * 6 + sizeof(int) * 3));
+    for (auto &node : bvh.nodes) {
+        node.bounds = readBounds(reader);
+        node.offset = reader.value<int>();
+        node.count = reader.value<int>();
+        node.axis = reader.value<int>();
+    }
+    reader.array(bvh.indices);
+    uint64_t triangles_count = reader.value<uint64_t>();
+    if (!reader.good()) {
+        return false;
+    }
+    for (auto *array : {&bvh.soa.v0x, &bvh.soa.v0y, &bvh.soa.v0z, &bvh.soa.e1x, &bvh.soa.e1y, &bvh.soa.e1z,
+                        &bvh.soa.e2x, &bvh.soa.e2y, &bvh.soa.e2z}) {
+        reader.array(*array);
+        if (triangles_count > 0 && array->size() != triangles_count + TriangleSoA::maxBatchSize) {
+            return false;
+        }
+    }
+    // Keeps the arrays read above and restores the triangle count
+    bvh.soa.resize(triangles_count);
+    if (!reader.good()) {
+        return false;
+    }
+
+    // Every index is checked, so traversal cannot leave the arrays: inner nodes point forward,
+    // which also rules out cycles, and leaves stay within indices
+    if (bvh.nodes.empty() ? !bvh.indices.empty() : bvh.indices.size() != primitives) {
+        return false;
+    }
+    if (triangles_count > 0 && triangles_count != bvh.indices.size()) {
+        return false;
+    }
+    for (int index : bvh.indices) {
+        if (index < 0 || index >= (int64_t) primitives) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < bvh.nodes.size(); i++) {
+        const BVHNode &node = bvh.nodes[i];
+        if (node.axis < 0 || node.axis > 2 || node.count < 0 || node.offset < 0) {
+            return false;
+        }
+        bool inside = node.count > 0
+                      ? (size_t) node.offset + node.count <= bvh.indices.size()
+                      : (size_t) node.offset > i + 1 && (size_t) node.offset < bvh.nodes.size();
+        if (!inside) {
+            return false;
+        }
+    }
+
+    // Traversal holds at most depth + 1 nodes on its fixed stack, a bound the builder keeps with
+    // maxSahDepth; children come after their parents, so one forward pass finds every depth
+    std::vector<int> depths(bvh.nodes.size(), -1);
+    if (!depths.empty()) {
+        depths[0] = 0;
+    }
+    for (size_t i = 0; i < bvh.nodes.size(); i++) {
+        if (depths[i] < 0 || bvh.nodes[i].count > 0) {
+            continue;
+        }
+        if (depths[i] + 1 >= BVH::maxStackSize) {
+            return false;
+        }
+        for (size_t child : {i + 1, (size_t) bvh.nodes[i].offset}) {
+            depths[child] = std::max(depths[child], depths[i] + 1);
+        }
+    }
+    return true;
+}
+
+int Scene::saveCache(const std::string &path_to_file, uint64_t source_hash) {
+    build();
+
+    CacheWriter writer(path_to_file);
+    if (!writer.good()) {
+        return 1;
+    }
+    for (char c : cacheMagic) {
+        writer.value(c);
+    }
+    writer.value(sceneCacheVersion);
+    writer.value((uint32_t) sizeof(Real));
+    writer.value(source_hash);
+
+    writer.value((uint64_t) materials.size());
+    for (const auto &material : materials) {
+        writer.vector(material.giveRGBCOlod());
+        writer.vector(material.giveBrightCoefficient());
+        writer.value(material.giveBRDF());
+    }
+    writer.value((uint64_t) materialIds.size());
+    for (const auto &[name, id] : materialIds) {
+        writer.string(name);
+        writer.value(id);
+    }
+
+    writer.value((uint64_t) lights.size());
+    for (const auto &light : lights) {
+        writer.vector(light.givePosition());
+        writer.vector(light.giveRGBIntensity());
+    }
+    writeSpectra(writer, materialSpectra);
+    writeSpectra(writer, lightSpectra);
+
+    writer.value((uint64_t) cameras.size());
+    for (const auto &camera : cameras) {
+        writer.value(camera.getWidth());
+        writer.value(camera.getHeight());
+        writer.value(camera.getFov());
+        writer.vector(camera.getPosition());
+        writer.value(camera.getAperture());
+        writer.value(camera.getFocusDistance());
+        writer.string(camera.getOutputPath());
+    }
+
+    writer.value((uint64_t) triangles.size());
+    for (const auto &triangle : triangles) {
+        Vec3r v0, v1, v2;
+        triangle.getVertices(v0, v1, v2);
+        writer.vector(v0);
+        writer.vector(v1);
+        writer.vector(v2);
+        writer.value(triangle.getMaterialId());
+    }
+
+    writer.value((uint64_t) meshes.size());
+    for (const auto &mesh : meshes) {
+        writer.value((uint64_t) mesh.vertices.size());
+        for (const auto &vertex : mesh.vertices) {
+            writer.vector(vertex);
+        }
+        writer.array(mesh.indices);
+        writeBVH(writer, mesh.bvh);
+    }
+
+    writer.value((uint64_t) instances.size());
+    for (const auto &instance : instances) {
+        writer.value(instance.mesh);
+        writer.value(instance.materialId);
+        writeTransform(writer, instance.objectToWorld);
+        writeTransform(writer, instance.worldToObject);
+    }
+
+    writeBVH(writer, bvh);
+    writeBVH(writer, instancesBvh);
+
+    writer.value((uint64_t) lightTree.nodes.size());
+    for (const auto &node : lightTree.nodes) {
+        writeBounds(writer, node.bounds);
+        writer.value(node.power);
+        writer.value(node.right);
+        writer.value(node.light);
+    }
+
+    return writer.good() ? 0 : 2;
+}
+
+int Scene::loadCache(const std::string &path_to_file, uint64_t source_hash) {
+    STATS_TIMER(Load);
+    MappedFile file;
+    if (file.open(path_to_file) != 0) {
+        return 1;
+    }
+    CacheReader reader(file.data(), file.size());
+
+    for (char c : cacheMagic) {
+        if (reader.value<char>() != c) {
+            return 2;
+        }
+    }
+    if (reader.value<uint32_t>() != sceneCacheVersion || reader.value<uint32_t>() != sizeof(Real)) {
+        return 2;
+    }
+    if (reader.value<uint64_t>() != source_hash) {
+        return 3;
+    }
+
+    // Everything is read into a fresh scene first, so a damaged file leaves this one untouched
+    Scene cached;
+
+    cached.materials.resize(reader.count(sizeof(Real) * 7));
+    for (auto &material : cached.materials) {
+        Vec3r color = reader.vector();
+        Vec3r bright_coefficient = reader.vector();
+        material = Material(color, bright_coefficient);
+        material.setBRDF(reader.value<Real>());
+    }
+    for (uint64_t i = 0, count = reader.count(sizeof(uint64_t) + sizeof(int)); i < count; i++) {
+        std::string name = reader.string();
+        cached.materialIds[name] = reader.value<int>();
+    }
+
+    cached.lights.resize(reader.count(sizeof(Real) * 6));
+    for (auto &light : cached.lights) {
+        Vec3r position = reader.vector();
+        light = Light(position, reader.vector());
+    }
+    readSpectra(reader, cached.materialSpectra);
+    readSpectra(reader, cached.lightSpectra);
+
+    for (uint64_t i = 0, count = reader.count(sizeof(int) * 2 + sizeof(Real) * 6 + sizeof(uint64_t)); i < count; i++) {
+        int width = reader.value<int>();
+        int height = reader.value<int>();
+        Real fov = reader.value<Real>();
+        cached.cameras.emplace_back(width, height, fov, reader.vector());
+        Real aperture = reader.value<Real>();
+        cached.cameras.back().setLens(aperture, reader.value<Real>());
+        cached.cameras.back().setOutputPath(reader.string());
+    }
+
+    for (uint64_t i = 0, count = reader.count(sizeof(Real) * 9 + sizeof(int)); i < count; i++) {
+        Vec3r v0 = reader.vector();
+        Vec3r v1 = reader.vector();
+        Vec3r v2 = reader.vector();
+        int id = reader.value<int>();
+        if (!reader.good() || id < 0 || id >= (int) cached.materials.size()) {
+            return 4;
+        }
+        cached.setNewTriangle(v0, v1, v2, id);
+    }
+
+    cached.meshes.resize(reader.count(sizeof(uint64_t) * 2));
+    for (auto &mesh : cached.meshes) {
+        mesh.vertices.resize(reader.count(sizeof(Real) * 3));
+        for (auto &vertex : mesh.vertices) {
+            vertex = reader.vector();
+        }
+        reader.array(mesh.indices);
+        if (mesh.indices.size() % 3 != 0) {
+            return 4;
+        }
+        for (int index : mesh.indices) {
+            if (index < 0 || index >= (int64_t) mesh.vertices.size()) {
+                return 4;
+            }
+        }
+        if (!readBVH(reader, mesh.bvh, mesh.indices.size() / 3)) {
+            return 4;
+        }
+        mesh.dirty = false;
+    }
+
+    cached.instances.resize(reader.count(sizeof(int) * 2 + sizeof(Real) * 24));
+    for (auto &instance : cached.instances) {
+        instance.mesh = reader.value<int>();
+        instance.materialId = reader.value<int>();
+        instance.objectToWorld = readTransform(reader);
+        instance.worldToObject = readTransform(reader);
+        if (instance.mesh < 0 || instance.mesh >= (int) cached.meshes.size() ||
+            instance.materialId < 0 || instance.materialId >= (int) cached.materials.size()) {
+            return 4;
+        }
+    }
+
+    if (!readBVH(reader, cached.bvh, cached.triangles.size()) ||
+        !readBVH(reader, cached.instancesBvh, cached.instances.size())) {
+        return 4;
+    }
+
+    cached.lightTree.nodes.resize(reader.count(sizeof(Real) * 7 + sizeof(int) * 2));
+    for (auto &node : cached.lightTree.nodes) {
+        node.bounds = readBounds(reader);
+        node.power = reader.value<Real>();
+        node.right = reader.value<int>();
+        node.light = reader.value<int>();
+    }
+    if (!reader.good()) {
+        return 4;
+    }
+    // A tree over N lights has 2N - 1 nodes; leaves name a light and inner nodes point forward
+    std::vector<LightTreeNode> &light_nodes = cached.lightTree.nodes;
+    if (light_nodes.size() != (cached.lights.empty() ? 0 : 2 * cached.lights.size() - 1)) {
+        return 4;
+    }
+    for (size_t i = 0; i < light_nodes.size(); i++) {
+        const LightTreeNode &node = light_nodes[i];
+        bool valid = node.light >= 0
+                     ? node.light < (int64_t) cached.lights.size()
+                     : node.light == -1 && node.right > (int64_t) i + 1 && node.right < (int64_t) light_nodes.size();
+        if (!valid) {
+            return 4;
+        }
+    }
+
+    materials = std::move(cached.materials);
+    materialIds = std::move(cached.materialIds);
+    lights = std::move(cached.lights);
+    materialSpectra = std::move(cached.materialSpectra);
+    lightSpectra = std::move(cached.lightSpectra);
+    cameras = std::move(cached.cameras);
+    meshes = std::move(cached.meshes);
+    instances = std::move(cached.instances);
+    bvh = std::move(cached.bvh);
+    instancesBvh = std::move(cached.instancesBvh);
+    lightTree = std::move(cached.lightTree);
+    // Moving the vector keeps its buffer, so the triangles still point into the materials
+    triangles = std::move(cached.triangles);
+    bvhDirty = false;
+    instancesDirty = false;
+    lightsDirty = false;
+    relightPaths.clear();
+    return 0;
+}
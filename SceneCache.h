@@ -0,0 +1,26 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//==============================================================================
+//================================ SceneCache ==================================
+//==============================================================================
+// Scene::saveCache writes the built scene (triangles, meshes, instances, materials,
+// lights and their spectra, cameras and every acceleration structure) to a versioned
+// binary file. Scene::loadCache reads it through a memory mapping of the file and
+// copies it into the scene, skipping parsing and BVH construction; every count and
+// index is checked on the way, so a damaged file is rejected rather than traced. The
+// file stores the hash of its source files, so a cache is only used for the exact
+// inputs it was made from.
+
+// Bumped whenever the layout of the file or of the cached structures changes
+constexpr uint32_t sceneCacheVersion = 4;
+
+// 64-bit FNV-1a over the contents of the files, in order. Returns 1, leaving hash unset,
+// if a file cannot be read: a key that skipped it would not change with its contents.
+int hashFiles(const std::vector<std::string> &paths, uint64_t &hash);
+
+#endif //SCENE_CACHE_H
@@ -0,0 +1,227 @@
+#include "ShpLoader.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <charconv>
+#include <map>
+#include <string_view>
+
+//==============================================================================
+//================================ ShpLoader ===================================
+//==============================================================================
+namespace {
+
+// Walks the mapped file one line at a time; ";;" starts a comment
+class LineReader {
+public:
+    LineReader(const char *begin, const char *end) : p(begin), end(end) {}
+
+    bool next() {
+        while (p < end) {
+            const char *line_end = std::find(p, end, '\n');
+            const char *comment = std::search(p, line_end, commentMark.begin(), commentMark.end());
+            cursor = p;
+            lineEnd = comment;
+            p = line_end + 1;
+            skipBlanks();
+            if (cursor < lineEnd) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string_view word() {
+        skipBlanks();
+        const char *begin = cursor;
+        while (cursor < lineEnd && !isBlank(*cursor)) {
+            cursor++;
+        }
+        return std::string_view(begin, cursor - begin);
+    }
+
+    template<typename T>
+    bool number(T &value) {
+        skipBlanks();
+        if (cursor < lineEnd && *cursor == '+') {
+            cursor++;
+        }
+        auto result = std::from_chars(cursor, lineEnd, value);
+        if (result.ec != std::errc()) {
+            return false;
+        }
+        cursor = result.ptr;
+        return true;
+    }
+
+    bool vector(double (&values)[3]) {
+        return number(values[0]) && number(values[1]) && number(values[2]);
+    }
+
+private:
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    void skipBlanks() {
+        while (cursor < lineEnd && isBlank(*cursor)) {
+            cursor++;
+        }
+    }
+
+private:
+    static constexpr std::string_view commentMark = ";;";
+    const char *p;
+    const char *end;
+    const char *cursor = nullptr;
+    const char *lineEnd = nullptr;
+};
+
+int parseBrep(LineReader &reader, ShpBrep &brep) {
+    // Blocks are appended: the indices of a triangles block count from the start of the
+    // vertices block before it
+    size_t first_vertex = 0;
+    while (reader.next()) {
+        std::string_view keyword = reader.word();
+        if (keyword == "enddef") {
+            return 0;
+        }
+
+        if (keyword == "vertices") {
+            int count;
+            if (!reader.number(count) || count < 0) {
+                return 2;
+            }
+            first_vertex = brep.vertices.size();
+            brep.vertices.resize(first_vertex + count);
+            for (size_t i = first_vertex; i < brep.vertices.size(); i++) {
+                double cords[3];
+                if (!reader.next() || !reader.vector(cords)) {
+                    return 2;
+                }
+                brep.vertices[i] = Vec3r(cords[0], cords[1], cords[2]);
+            }
+        } else if (keyword == "triangles") {
+            int count;
+            if (!reader.number(count) || count < 0) {
+                return 2;
+            }
+            size_t first_index = brep.indices.size();
+            brep.indices.resize(first_index + 3 * (size_t) count);
+            for (int i = 0; i < count; i++) {
+                if (!reader.next()) {
+                    return 2;
+                }
+                for (int k = 0; k < 3; k++) {
+                    int &index = brep.indices[first_index + 3 * i + k];
+                    if (!reader.number(index)) {
+                        return 2;
+                    }
+                    if (index < 0 || index >= (int64_t) (brep.vertices.size() - first_vertex)) {
+                        return 3;
+                    }
+                    index += (int) first_vertex;
+                }
+            }
+        }
+        // GeoChecked, parts and other per-brep data are skipped up to enddef
+    }
+    return 2;
+}
+
+int parsePlacement(LineReader &reader, ShpPlacement &placement) {
+    double rotation[3] = {0, 0, 0};
+    double translation[3] = {0, 0, 0};
+    double scale[3] = {1, 1, 1};
+
+    while (reader.next()) {
+        std::string_view keyword = reader.word();
+        if (keyword == "enddef") {
+            Transform rotate = Transform::rotate(Vec3r(0, 0, 1), rotation[2] * M_PI / 180) *
+                               Transform::rotate(Vec3r(0, 1, 0), rotation[1] * M_PI / 180) *
+                               Transform::rotate(Vec3r(1, 0, 0), rotation[0] * M_PI / 180);
+            placement.transform = Transform::translate(Vec3r(translation[0], translation[1], translation[2])) *
+                                  rotate * Transform::scale(Vec3r(scale[0], scale[1], scale[2]));
+            return 0;
+        }
+
+        bool valid = true;
+        if (keyword == "rotation") {
+            valid = reader.vector(rotation);
+        } else if (keyword == "translation") {
+            valid = reader.vector(translation);
+        } else if (keyword == "scale") {
+            valid = reader.vector(scale);
+        }
+        if (!valid) {
+            return 2;
+        }
+    }
+    return 2;
+}
+
+// Blocks other than breps (ProcessMesh, ...) are skipped as a whole
+bool skipBlock(LineReader &reader) {
+    while (reader.next()) {
+        if (reader.word() == "enddef") {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+int loadShp(const std::string &path_to_file, ShpScene &scene) {
+    MappedFile file;
+    if (file.open(path_to_file) != 0) {
+        return 1;
+    }
+
+    scene.breps.clear();
+    scene.placements.clear();
+    std::map<std::string, int, std::less<>> brep_ids;
+    std::vector<char> placed;
+
+    LineReader reader(file.data(), file.data() + file.size());
+    while (reader.next()) {
+        std::string_view keyword = reader.word();
+        std::string_view type = reader.word();
+        std::string_view name = reader.word();
+
+        int exit_code = 0;
+        if (keyword == "define" && type == "breps") {
+            ShpBrep brep;
+            brep.name = std::string(name);
+            exit_code = parseBrep(reader, brep);
+            brep_ids[brep.name] = (int) scene.breps.size();
+            scene.breps.emplace_back(std::move(brep));
+            placed.push_back(0);
+        } else if (keyword == "set" && type == "breps") {
+            auto found = brep_ids.find(name);
+            if (found == brep_ids.end()) {
+                return 3;
+            }
+            ShpPlacement placement;
+            placement.brep = found->second;
+            exit_code = parsePlacement(reader, placement);
+            scene.placements.push_back(placement);
+            placed[found->second] = 1;
+        } else if (!skipBlock(reader)) {
+            exit_code = 2;
+        }
+
+        if (exit_code != 0) {
+            return exit_code;
+        }
+    }
+
+    for (int i = 0; i < scene.breps.size(); i++) {
+        if (!placed[i]) {
+            ShpPlacement placement;
+            placement.brep = i;
+            scene.placements.push_back(placement);
+        }
+    }
+    return 0;
+}
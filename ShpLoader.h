@@ -0,0 +1,37 @@
+#ifndef SHP_LOADER_H
+#define SHP_LOADER_H
+
+#include "RenderTools.h"
+
+#include <string>
+#include <vector>
+
+//==============================================================================
+//================================ ShpLoader ===================================
+//==============================================================================
+// Geometry of a Lumicept .shp scene. Every `define breps` block becomes an indexed
+// mesh, its vertices and triangles blocks appended in order, and every `set breps`
+// block places one of them with its rotation (degrees, applied about x, then y, then
+// z), translation and scale.
+struct ShpBrep {
+    std::string name;
+    std::vector<Vec3r> vertices;
+    std::vector<int> indices;       // three per triangle
+};
+
+struct ShpPlacement {
+    int brep = -1;
+    Transform transform;
+};
+
+struct ShpScene {
+    std::vector<ShpBrep> breps;
+    std::vector<ShpPlacement> placements;
+};
+
+// Returns 0 on success, 1 if the file cannot be read, 2 on a malformed block and 3 on
+// a triangle index outside its brep or a `set breps` naming an undefined brep.
+// Breps that are never set are placed once with the identity transform.
+int loadShp(const std::string &path_to_file, ShpScene &scene);
+
+#endif //SHP_LOADER_H
@@ -0,0 +1,103 @@
+#include "RenderTools.h"
+
+//==============================================================================
+//================================ Spectral ====================================
+//==============================================================================
+// Hero-wavelength paths: the path is that of tracePath, with a SpectralSample in place
+// of every RGB quantity. All lanes have the same probability for every path, so the
+// hero weights reduce to dividing the range among the lanes.
+Vec3r Scene::traceSpectral(const Ray &ray, Sampler &sampler, const Hit *first) const {
+    // The first path dimension places the hero, the light choices and roulette follow it
+    SpectralSample wavelengths;
+    Real hero = sampler.get1D();
+    for (int k = 0; k < spectralLanes; k++) {
+        Real u = hero + Real(k) / spectralLanes;
+        wavelengths[k] = minWavelength + (u < 1 ? u : u - 1) * (maxWavelength - minWavelength);
+    }
+
+    SpectralSample radiance;
+    SpectralSample throughput(1);
+    Ray pathRay = ray;
+    Real weight = 1;       // every bounce is divided by PI
+    int surfaces = 0;
+
+    for (int depth = 0; depth < maxDepth; depth++) {
+        Hit hit;
+        if (depth == 0 && first) {
+            hit = *first;
+        } else {
+            closestHit(pathRay, hit);
+        }
+        if (depth > 0) {
+            STATS_ADD(reflectionRays, 1);
+        }
+        if (hit.triangle < 0) {
+            break;
+        }
+        surfaces++;
+        Vec3r point, N;
+        Material material;
+        getHitSurface(pathRay, hit, point, N, material);
+
+        weight /= M_PI;
+        SpectralSample reflected = getReflectance(getHitMaterialId(hit), wavelengths) * throughput;
+        for (int s = 0; s < getLightsPerHit(); s++) {
+            Real scale;
+            int light = chooseLight(s, point, sampler, scale);
+            radiance += spectralLightContribution(light, point, N, material, reflected, wavelengths) * (weight * scale);
+        }
+
+        if (material.giveBRDF() == 0) {
+            break;
+        }
+        throughput = reflected * material.giveBRDF();
+
+        // Russian roulette on the brightest lane, as tracePath does on the brightest channel
+        Real contribution = weight * throughput.max();
+        if (contribution < rouletteThreshold) {
+            Real survival = contribution / rouletteThreshold;
+            if (sampler.get1D() >= survival) {
+                break;
+            }
+            throughput = throughput * (1 / survival);
+        }
+
+        pathRay = Ray(offsetRayOrigin(point, N, 0), get_normalized(pathRay.direction + 2 * N));
+    }
+    STATS_DEPTH(surfaces, 1);
+
+    // A lane estimates the XYZ integral with its share of the whole range
+    Vec3r xyz(0, 0, 0);
+    Real width = (maxWavelength - minWavelength) / spectralLanes;
+    for (int k = 0; k < spectralLanes; k++) {
+        xyz += getCIEXYZ(wavelengths[k]) * (radiance[k] * width);
+    }
+    return convertXYZToRGB(xyz);
+}
+
+SpectralSample Scene::getReflectance(int materialId, const SpectralSample &wavelengths) const {
+    if (materialId < materialSpectra.size() && !materialSpectra[materialId].empty()) {
+        return materialSpectra[materialId].evaluate(wavelengths);
+    }
+    return Spectrum::evaluateRGB(materials[materialId].giveRGBCOlod(), wavelengths);
+}
+
+SpectralSample Scene::spectralLightContribution(int light, const Vec3r &point, const Vec3r &N,
+                                                const Material &material, const SpectralSample &reflected,
+                                                const SpectralSample &wavelengths) const {
+    SpectralSample intensity = light < lightSpectra.size() && !lightSpectra[light].empty()
+                               ? lightSpectra[light].evaluate(wavelengths)
+                               : Spectrum::evaluateRGBIntegral(lights[light].giveRGBIntensity(), wavelengths);
+
+    // The factors of sampleLight
+    Vec3r light_dir = get_normalized(lights[light].givePosition() - point);
+    Real dist = get_length(lights[light].givePosition() - point);
+    Real cos_theta = light_dir.dot(N);
+    Real factor = (1 - material.giveBRDF()) * cos_theta / (dist * dist);
+    if (cos_theta <= 0 && lightInShadows) {
+        factor *= -0.008;
+    } else if (lightInShadows && occluded(Ray(offsetRayOrigin(point, N, 1e-3), light_dir), dist)) {
+        factor *= 0.008;
+    }
+    return intensity * reflected * factor;
+}
@@ -0,0 +1,92 @@
+#include "Spectrum.h"
+
+#include <cmath>
+
+//==============================================================================
+//================================ Wavelengths =================================
+//==============================================================================
+// A Gaussian with separate widths below and above the mean
+static Real lobe(Real wavelength, Real mean, Real below, Real above) {
+    Real t = (wavelength - mean) / (wavelength < mean ? below : above);
+    return std::exp(Real(-0.5) * t * t);
+}
+
+Vec3r getCIEXYZ(Real wavelength) {
+    return Vec3r(1.056 * lobe(wavelength, 599.8, 37.9, 31.0) + 0.362 * lobe(wavelength, 442.0, 16.0, 26.7)
+                 - 0.065 * lobe(wavelength, 501.1, 20.4, 26.2),
+                 0.821 * lobe(wavelength, 568.8, 46.9, 40.5) + 0.286 * lobe(wavelength, 530.9, 16.3, 31.1),
+                 1.217 * lobe(wavelength, 437.0, 11.8, 36.0) + 0.681 * lobe(wavelength, 459.0, 26.0, 13.8));
+}
+
+Vec3r convertXYZToRGB(const Vec3r &xyz) {
+    // The inverse of the matrix whose columns are the primaries red (0.622, 0.330),
+    // green (0.283, 0.619) and blue (0.144, 0.070) scaled to add up to the white
+    // (0.312750, 0.329059) at Y = 1
+    return Vec3r(2.787010 * xyz[0] - 1.210419 * xyz[1] - 0.402799 * xyz[2],
+                 -1.053661 * xyz[0] + 1.983609 * xyz[1] + 0.016380 * xyz[2],
+                 0.009641 * xyz[0] - 0.173796 * xyz[1] + 1.069912 * xyz[2]);
+}
+
+//==============================================================================
+//================================ Spectrum ====================================
+//==============================================================================
+Spectrum::Spectrum(std::vector<Real> wavelengths, std::vector<Real> values)
+        : wavelengths(std::move(wavelengths)), values(std::move(values)) {
+    this->values.resize(this->wavelengths.size(), Real(0));
+}
+
+Spectrum Spectrum::fromRGB(const Vec3r &rgb) {
+    // A step at every inner edge: the upper band starts at the edge
+    return Spectrum({bandEdges[0], bandEdges[1], bandEdges[1], bandEdges[2], bandEdges[2], bandEdges[3]},
+                    {rgb[2], rgb[2], rgb[1], rgb[1], rgb[0], rgb[0]});
+}
+
+Spectrum Spectrum::fromRGBIntegral(const Vec3r &rgb) {
+    return fromRGB(Vec3r(rgb[0] / (bandEdges[3] - bandEdges[2]), rgb[1] / (bandEdges[2] - bandEdges[1]),
+                         rgb[2] / (bandEdges[1] - bandEdges[0])));
+}
+
+SpectralSample Spectrum::evaluateRGB(const Vec3r &rgb, const SpectralSample &wavelengths) {
+    SpectralSample result;
+    for (int k = 0; k < spectralLanes; k++) {
+        result[k] = rgb[getBand(wavelengths[k])];
+    }
+    return result;
+}
+
+SpectralSample Spectrum::evaluateRGBIntegral(const Vec3r &rgb, const SpectralSample &wavelengths) {
+    SpectralSample result;
+    for (int k = 0; k < spectralLanes; k++) {
+        int band = getBand(wavelengths[k]);
+        result[k] = rgb[band] / (bandEdges[3 - band] - bandEdges[2 - band]);
+    }
+    return result;
+}
+
+Real Spectrum::evaluate(Real wavelength) const {
+    if (wavelengths.empty()) {
+        return 0;
+    }
+    auto next = std::upper_bound(wavelengths.begin(), wavelengths.end(), wavelength);
+    if (next == wavelengths.begin()) {
+        return values.front();
+    }
+    if (next == wavelengths.end()) {
+        return values.back();
+    }
+    size_t i = next - wavelengths.begin();
+    Real width = wavelengths[i] - wavelengths[i - 1];
+    if (width <= 0) {
+        return values[i];
+    }
+    Real t = (wavelength - wavelengths[i - 1]) / width;
+    return values[i - 1] + t * (values[i] - values[i - 1]);
+}
+
+SpectralSample Spectrum::evaluate(const SpectralSample &wavelengths) const {
+    SpectralSample result;
+    for (int k = 0; k < spectralLanes; k++) {
+        result[k] = evaluate(wavelengths[k]);
+    }
+    return result;
+}
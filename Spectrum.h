@@ -0,0 +1,118 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include "Precision.h"
+
+#include <algorithm>
+#include <vector>
+
+//==============================================================================
+//================================ Wavelengths =================================
+//==============================================================================
+// Spectral mode traces [minWavelength, maxWavelength) nm and integrates the spectral
+// radiance against the CIE 1931 matching functions; the image channels are that XYZ in
+// the linear RGB of the .nit writer's primaries. Materials and lights without a curve
+// stand for the spectrum that is constant over the bands of their RGB channels, red
+// [590, 780), green [490, 590) and blue [380, 490).
+// Configure with -DPATH_TRACING_SPECTRAL_LANES=8 to carry 8 wavelengths per path.
+#ifndef PATH_TRACING_SPECTRAL_LANES
+#define PATH_TRACING_SPECTRAL_LANES 4
+#endif
+
+constexpr int spectralLanes = PATH_TRACING_SPECTRAL_LANES;
+constexpr Real minWavelength = 380;
+constexpr Real maxWavelength = 780;
+constexpr Real bandEdges[4] = {380, 490, 590, 780};
+
+// Channel of the band holding the wavelength, 0 - red, 1 - green, 2 - blue
+inline int getBand(Real wavelength) {
+    return wavelength < bandEdges[1] ? 2 : (wavelength < bandEdges[2] ? 1 : 0);
+}
+
+// CIE 1931 2-degree matching functions x, y and z at the wavelength, by the multi-lobe
+// Gaussian fit of Wyman, Sloan and Shirley (2013), within about 1% of the tables
+Vec3r getCIEXYZ(Real wavelength);
+// Linear RGB of the primaries and white point the .nit header records
+Vec3r convertXYZToRGB(const Vec3r &xyz);
+
+//==============================================================================
+//================================ SpectralSample ==============================
+//==============================================================================
+// One value per wavelength of a path. The lanes are a fixed-size aligned array and
+// every operation is a plain loop over them, which the compiler turns into SIMD.
+struct alignas(sizeof(Real) * spectralLanes) SpectralSample {
+public:
+    SpectralSample() = default;
+    explicit SpectralSample(Real value) {
+        for (int k = 0; k < spectralLanes; k++) {
+            lanes[k] = value;
+        }
+    }
+
+    Real &operator[](int k) { return lanes[k]; }
+    Real operator[](int k) const { return lanes[k]; }
+
+    SpectralSample &operator+=(const SpectralSample &other) {
+        for (int k = 0; k < spectralLanes; k++) {
+            lanes[k] += other.lanes[k];
+        }
+        return *this;
+    }
+    SpectralSample operator*(const SpectralSample &other) const {
+        SpectralSample result;
+        for (int k = 0; k < spectralLanes; k++) {
+            result.lanes[k] = lanes[k] * other.lanes[k];
+        }
+        return result;
+    }
+    SpectralSample operator*(Real factor) const {
+        SpectralSample result;
+        for (int k = 0; k < spectralLanes; k++) {
+            result.lanes[k] = lanes[k] * factor;
+        }
+        return result;
+    }
+    Real max() const {
+        Real result = lanes[0];
+        for (int k = 1; k < spectralLanes; k++) {
+            result = std::max(result, lanes[k]);
+        }
+        return result;
+    }
+
+public:
+    Real lanes[spectralLanes] = {};
+};
+
+//==============================================================================
+//================================ Spectrum ====================================
+//==============================================================================
+// A curve sampled at increasing wavelengths, linear in between and constant past
+// the ends: a reflectance, or a light's intensity per nm.
+class Spectrum {
+public:
+    Spectrum() = default;   // no samples - empty()
+    Spectrum(std::vector<Real> wavelengths, std::vector<Real> values);
+
+    // Constant over each band at the channel's value, the spectrum RGB mode stands for;
+    // fromRGBIntegral divides by the band widths, for channels that are band integrals
+    // such as a light's intensity
+    static Spectrum fromRGB(const Vec3r &rgb);
+    static Spectrum fromRGBIntegral(const Vec3r &rgb);
+    // The same without building the curve
+    static SpectralSample evaluateRGB(const Vec3r &rgb, const SpectralSample &wavelengths);
+    static SpectralSample evaluateRGBIntegral(const Vec3r &rgb, const SpectralSample &wavelengths);
+
+    bool empty() const { return wavelengths.empty(); }
+    Real evaluate(Real wavelength) const;
+    SpectralSample evaluate(const SpectralSample &wavelengths) const;
+
+    const std::vector<Real> &getWavelengths() const { return wavelengths; }
+    const std::vector<Real> &getValues() const { return values; }
+
+private:
+    std::vector<Real> wavelengths;
+    std::vector<Real> values;
+};
+
+#endif //SPECTRUM_H
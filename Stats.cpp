@@ -0,0 +1,119 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+//==============================================================================
+//================================ Stats =======================================
+//==============================================================================
+namespace {
+
+const char *const phaseNames[RenderStats::phasesCount] = {"load", "build", "render", "trace", "write"};
+
+// Live threads register their counters here; an exiting thread folds its counters into retired
+struct Registry {
+    std::mutex mutex;
+    std::vector<RenderStats *> threads;
+    RenderStats retired;
+};
+
+Registry &getRegistry() {
+    // Never destroyed, so threads exiting after main() still find it
+    static Registry *registry = new Registry();
+    return *registry;
+}
+
+struct ThreadStats {
+    RenderStats stats;
+
+    ThreadStats() {
+        Registry &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.threads.push_back(&stats);
+    }
+
+    ~ThreadStats() {
+        Registry &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.retired += stats;
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &stats));
+    }
+};
+
+}
+
+RenderStats &RenderStats::operator+=(const RenderStats &other) {
+    cameraRays += other.cameraRays;
+    shadowRays += other.shadowRays;
+    reflectionRays += other.reflectionRays;
+    triangleTests += other.triangleTests;
+    nodeVisits += other.nodeVisits;
+    for (int i = 0; i < depthBins; i++) {
+        depths[i] += other.depths[i];
+    }
+    for (int i = 0; i < phasesCount; i++) {
+        seconds[i] += other.seconds[i];
+    }
+    return *this;
+}
+
+RenderStats &getThreadStats() {
+    thread_local ThreadStats thread_stats;
+    return thread_stats.stats;
+}
+
+RenderStats collectStats() {
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    RenderStats total = registry.retired;
+    for (const RenderStats *stats : registry.threads) {
+        total += *stats;
+    }
+    return total;
+}
+
+void resetStats() {
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.retired = RenderStats();
+    for (RenderStats *stats : registry.threads) {
+        *stats = RenderStats();
+    }
+}
+
+int writeStatsJson(const std::string &path_to_file, const RenderStats &stats) {
+    std::ofstream file(path_to_file);
+    if (!file) {
+        return 1;
+    }
+#ifdef PATH_TRACING_STATS
+    file << "{\n  \"enabled\": true,\n";
+#else
+    file << "{\n  \"enabled\": false,\n";
+#endif
+    file << "  \"rays\": {\"camera\": " << stats.cameraRays << ", \"shadow\": " << stats.shadowRays
+         << ", \"reflection\": " << stats.reflectionRays << ", \"total\": "
+         << stats.cameraRays + stats.shadowRays + stats.reflectionRays << "},\n";
+    file << "  \"triangle_tests\": " << stats.triangleTests << ",\n";
+    file << "  \"node_visits\": " << stats.nodeVisits << ",\n";
+
+    // Trailing empty bins are left out
+    int bins = RenderStats::depthBins;
+    while (bins > 0 && stats.depths[bins - 1] == 0) {
+        bins--;
+    }
+    file << "  \"depths\": [";
+    for (int i = 0; i < bins; i++) {
+        file << (i > 0 ? ", " : "") << stats.depths[i];
+    }
+    file << "],\n";
+
+    file << "  \"seconds\": {";
+    for (int i = 0; i < RenderStats::phasesCount; i++) {
+        file << (i > 0 ? ", " : "") << "\"" << phaseNames[i] << "\": " << stats.seconds[i];
+    }
+    file << "}\n}\n";
+    return file.good() ? 0 : 1;
+}
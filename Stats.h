@@ -0,0 +1,78 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <string>
+
+//==============================================================================
+//================================ Stats =======================================
+//==============================================================================
+// Render statistics: ray and BVH work counters, a histogram of path lengths and the
+// time spent in the phases of a render. Every thread adds to its own counters, which
+// are merged by collectStats(), so the hot paths never share a cache line. Counting
+// is compiled in only with PATH_TRACING_STATS; without it the STATS_ macros expand
+// to nothing and collectStats() returns zeros.
+enum class StatsPhase {
+    Load,       // scene descriptions, meshes and caches
+    Build,      // acceleration structures
+    Render,     // the whole of Scene::render and Scene::relight, on the calling thread
+    Trace,      // tiles, passes and wavefront bands, summed over the threads
+    Write,      // image output, summed over the threads
+    Count
+};
+
+struct RenderStats {
+    static constexpr int depthBins = 32;        // paths with more surface hits go to the last bin
+    static constexpr int phasesCount = (int) StatsPhase::Count;
+
+    long long cameraRays = 0;
+    long long shadowRays = 0;
+    long long reflectionRays = 0;
+    long long triangleTests = 0;
+    long long nodeVisits = 0;
+    long long depths[depthBins] = {};           // paths by their number of surface hits
+    double seconds[phasesCount] = {};
+
+    void addDepth(int depth, long long count) {
+        depths[depth < depthBins ? depth : depthBins - 1] += count;
+    }
+    RenderStats &operator+=(const RenderStats &other);
+};
+
+// The counters of the calling thread
+RenderStats &getThreadStats();
+// Sum over every thread, including the ones that have exited since the last reset. The counters
+// are read without synchronization, so this and resetStats() are meant for moments when no
+// render is running, e.g. after Scene::render returns.
+RenderStats collectStats();
+void resetStats();
+// Returns 0 on success and 1 if the file cannot be written
+int writeStatsJson(const std::string &path_to_file, const RenderStats &stats);
+
+// Adds the lifetime of the object to a phase of the calling thread
+class ScopedTimer {
+public:
+    explicit ScopedTimer(StatsPhase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        getThreadStats().seconds[(int) phase] +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    StatsPhase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef PATH_TRACING_STATS
+#define STATS_ADD(counter, count) (getThreadStats().counter += (count))
+#define STATS_DEPTH(depth, count) getThreadStats().addDepth(depth, count)
+#define STATS_TIMER(phase) ScopedTimer stats_timer(StatsPhase::phase)
+#else
+#define STATS_ADD(counter, count) ((void) 0)
+#define STATS_DEPTH(depth, count) ((void) 0)
+#define STATS_TIMER(phase) ((void) 0)
+#endif
+
+#endif //STATS_H
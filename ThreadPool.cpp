@@ -0,0 +1,126 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+//==============================================================================
+//================================ ThreadPool ==================================
+//==============================================================================
+ThreadPool::ThreadPool(int threadsCount) {
+    if (threadsCount <= 0) {
+        threadsCount = (int) std::thread::hardware_concurrency();
+    }
+    this->threadsCount = std::max(1, threadsCount);
+
+    for (int i = 0; i < this->threadsCount; i++) {
+        queues.emplace_back(std::make_unique<WorkQueue>());
+    }
+    for (int i = 1; i < this->threadsCount; i++) {
+        threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    start.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+int ThreadPool::getThreadsCount() const {
+    return threadsCount;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)> &task) {
+    if (count <= 0) {
+        return;
+    }
+
+    // Contiguous ranges per worker keep neighbouring tiles on one core until stealing starts
+    for (int worker = 0; worker < threadsCount; worker++) {
+        int begin = (int) ((long long) count * worker / threadsCount);
+        int end = (int) ((long long) count * (worker + 1) / threadsCount);
+        std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+        for (int index = begin; index < end; index++) {
+            queues[worker]->items.push_back(index);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        error = nullptr;
+        busyWorkers = threadsCount;
+        generation++;
+    }
+    start.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finish.wait(lock, [this]() { return busyWorkers == 0; });
+    this->task = nullptr;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::workerLoop(int worker) {
+    long long seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]() { return stop || generation != seen_generation; });
+            if (stop) {
+                return;
+            }
+            seen_generation = generation;
+        }
+        runTasks(worker);
+    }
+}
+
+void ThreadPool::runTasks(int worker) {
+    int index;
+    while (popTask(worker, index)) {
+        try {
+            (*task)(index, worker);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--busyWorkers == 0) {
+        finish.notify_all();
+    }
+}
+
+bool ThreadPool::popTask(int worker, int &index) {
+    {
+        WorkQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.items.empty()) {
+            index = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+
+    for (int offset = 1; offset < threadsCount; offset++) {
+        WorkQueue &victim = *queues[(worker + offset) % threadsCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            index = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
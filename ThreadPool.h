@@ -0,0 +1,58 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//==============================================================================
+//================================ ThreadPool ==================================
+//==============================================================================
+// Persistent workers with one task deque per worker. A worker takes tasks from
+// the back of its own deque and, once it is empty, steals from the front of the
+// others, so expensive tiles do not leave the remaining threads idle.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadsCount = 0);   // 0 - one thread per hardware core
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int getThreadsCount() const;
+
+    // Calls task(index, worker) for every index in [0, count) and blocks until all calls
+    // are done. The calling thread works as worker 0. The first exception is rethrown.
+    void parallelFor(int count, const std::function<void(int index, int worker)> &task);
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> items;
+    };
+
+    void workerLoop(int worker);
+    void runTasks(int worker);
+    bool popTask(int worker, int &index);
+
+private:
+    int threadsCount = 1;
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable finish;
+    const std::function<void(int, int)> *task = nullptr;
+    long long generation = 0;
+    int busyWorkers = 0;
+    bool stop = false;
+    std::exception_ptr error;
+};
+
+#endif //THREAD_POOL_H
@@ -0,0 +1,317 @@
+#include "TriangleKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIANGLE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+//==============================================================================
+//================================ TriangleSoA =================================
+//==============================================================================
+void TriangleSoA::clear() {
+    for (auto *array : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) {
+        array->clear();
+    }
+    count = 0;
+}
+
+void TriangleSoA::reserve(size_t count) {
+    for (auto *array : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) {
+        array->reserve(count + maxBatchSize);
+    }
+}
+
+void TriangleSoA::resize(size_t count) {
+    this->count = count;
+    for (auto *array : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) {
+        array->resize(count + maxBatchSize, Real(0));
+    }
+}
+
+void TriangleSoA::push(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2) {
+    Vec3r e1 = v1 - v0;
+    Vec3r e2 = v2 - v0;
+    v0x.push_back(v0[0]);
+    v0y.push_back(v0[1]);
+    v0z.push_back(v0[2]);
+    e1x.push_back(e1[0]);
+    e1y.push_back(e1[1]);
+    e1z.push_back(e1[2]);
+    e2x.push_back(e2[0]);
+    e2y.push_back(e2[1]);
+    e2z.push_back(e2[2]);
+    count++;
+}
+
+void TriangleSoA::set(size_t i, const Vec3r &v0, const Vec3r &v1, const Vec3r &v2) {
+    Vec3r e1 = v1 - v0;
+    Vec3r e2 = v2 - v0;
+    v0x[i] = v0[0];
+    v0y[i] = v0[1];
+    v0z[i] = v0[2];
+    e1x[i] = e1[0];
+    e1y[i] = e1[1];
+    e1z[i] = e1[2];
+    e2x[i] = e2[0];
+    e2y[i] = e2[1];
+    e2z[i] = e2[2];
+}
+
+void TriangleSoA::finalize() {
+    for (auto *array : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) {
+        array->resize(count + maxBatchSize, Real(0));
+    }
+}
+
+//==============================================================================
+//================================ Scalar kernel ===============================
+//==============================================================================
+static int intersectScalar(const TriangleSoA &soa, int first, int count,
+                           const Real origin[3], const Real direction[3], Real t[]) {
+    int mask = 0;
+    for (int lane = 0; lane < count; lane++) {
+        int i = first + lane;
+        Real px = direction[1] * soa.e2z[i] - direction[2] * soa.e2y[i];
+        Real py = direction[2] * soa.e2x[i] - direction[0] * soa.e2z[i];
+        Real pz = direction[0] * soa.e2y[i] - direction[1] * soa.e2x[i];
+        Real det = soa.e1x[i] * px + soa.e1y[i] * py + soa.e1z[i] * pz;
+        if (det < Real(1e-8) && det > Real(-1e-8)) {
+            continue;
+        }
+
+        Real inv_det = 1 / det;
+        Real tx = origin[0] - soa.v0x[i];
+        Real ty = origin[1] - soa.v0y[i];
+        Real tz = origin[2] - soa.v0z[i];
+        Real u = (tx * px + ty * py + tz * pz) * inv_det;
+        if (u < 0 || u > 1) {
+            continue;
+        }
+
+        Real qx = ty * soa.e1z[i] - tz * soa.e1y[i];
+        Real qy = tz * soa.e1x[i] - tx * soa.e1z[i];
+        Real qz = tx * soa.e1y[i] - ty * soa.e1x[i];
+        Real v = (direction[0] * qx + direction[1] * qy + direction[2] * qz) * inv_det;
+        if (v < 0 || v + u > 1) {
+            continue;
+        }
+
+        Real distance = (soa.e2x[i] * qx + soa.e2y[i] * qy + soa.e2z[i] * qz) * inv_det;
+        if (distance > Real(1e-8)) {
+            t[lane] = distance;
+            mask |= 1 << lane;
+        }
+    }
+    return mask;
+}
+
+#if defined(TRIANGLE_KERNELS_X86) && defined(PATH_TRACING_SINGLE_PRECISION)
+//==============================================================================
+//================================ AVX2 kernel (float) =========================
+//==============================================================================
+// Eight floats fill one 256-bit register, so a whole leaf is tested in one pass and
+// AVX-512 would leave half of its lanes empty. No FMA, as in the double kernels.
+__attribute__((target("avx2")))
+static int intersectAvx2(const TriangleSoA &soa, int first, int count,
+                         const Real origin[3], const Real direction[3], Real t[]) {
+    const __m256 dx = _mm256_set1_ps(direction[0]);
+    const __m256 dy = _mm256_set1_ps(direction[1]);
+    const __m256 dz = _mm256_set1_ps(direction[2]);
+
+    const __m256 e1x = _mm256_loadu_ps(&soa.e1x[first]);
+    const __m256 e1y = _mm256_loadu_ps(&soa.e1y[first]);
+    const __m256 e1z = _mm256_loadu_ps(&soa.e1z[first]);
+    const __m256 e2x = _mm256_loadu_ps(&soa.e2x[first]);
+    const __m256 e2y = _mm256_loadu_ps(&soa.e2y[first]);
+    const __m256 e2z = _mm256_loadu_ps(&soa.e2z[first]);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+                               _mm256_mul_ps(e1z, pz));
+    __m256 reject = _mm256_and_ps(_mm256_cmp_ps(det, _mm256_set1_ps(1e-8f), _CMP_LT_OQ),
+                                  _mm256_cmp_ps(det, _mm256_set1_ps(-1e-8f), _CMP_GT_OQ));
+
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(origin[0]), _mm256_loadu_ps(&soa.v0x[first]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(origin[1]), _mm256_loadu_ps(&soa.v0y[first]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(origin[2]), _mm256_loadu_ps(&soa.v0z[first]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                                           _mm256_mul_ps(tz, pz)), inv_det);
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_LT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(u, _mm256_set1_ps(1.0f), _CMP_GT_OQ));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                           _mm256_mul_ps(dz, qz)), inv_det);
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(_mm256_add_ps(v, u), _mm256_set1_ps(1.0f), _CMP_GT_OQ));
+
+    __m256 distance = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                                  _mm256_mul_ps(e2z, qz)), inv_det);
+    __m256 accept = _mm256_andnot_ps(reject, _mm256_cmp_ps(distance, _mm256_set1_ps(1e-8f), _CMP_GT_OQ));
+
+    _mm256_storeu_ps(t, distance);
+    return _mm256_movemask_ps(accept) & ((1 << count) - 1);
+}
+#elif defined(TRIANGLE_KERNELS_X86)
+//==============================================================================
+//================================ AVX2 kernel =================================
+//==============================================================================
+// No FMA on purpose: fused multiply-adds would round differently from the scalar path.
+__attribute__((target("avx2")))
+static int intersectAvx2Half(const TriangleSoA &soa, int first, int count,
+                             const double origin[3], const double direction[3], double t[]) {
+    const __m256d dx = _mm256_set1_pd(direction[0]);
+    const __m256d dy = _mm256_set1_pd(direction[1]);
+    const __m256d dz = _mm256_set1_pd(direction[2]);
+
+    const __m256d e1x = _mm256_loadu_pd(&soa.e1x[first]);
+    const __m256d e1y = _mm256_loadu_pd(&soa.e1y[first]);
+    const __m256d e1z = _mm256_loadu_pd(&soa.e1z[first]);
+    const __m256d e2x = _mm256_loadu_pd(&soa.e2x[first]);
+    const __m256d e2y = _mm256_loadu_pd(&soa.e2y[first]);
+    const __m256d e2z = _mm256_loadu_pd(&soa.e2z[first]);
+
+    __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+    __m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)),
+                                _mm256_mul_pd(e1z, pz));
+    __m256d reject = _mm256_and_pd(_mm256_cmp_pd(det, _mm256_set1_pd(1e-8), _CMP_LT_OQ),
+                                   _mm256_cmp_pd(det, _mm256_set1_pd(-1e-8), _CMP_GT_OQ));
+
+    __m256d inv_det = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+    __m256d tx = _mm256_sub_pd(_mm256_set1_pd(origin[0]), _mm256_loadu_pd(&soa.v0x[first]));
+    __m256d ty = _mm256_sub_pd(_mm256_set1_pd(origin[1]), _mm256_loadu_pd(&soa.v0y[first]));
+    __m256d tz = _mm256_sub_pd(_mm256_set1_pd(origin[2]), _mm256_loadu_pd(&soa.v0z[first]));
+    __m256d u = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, px), _mm256_mul_pd(ty, py)),
+                                            _mm256_mul_pd(tz, pz)), inv_det);
+    reject = _mm256_or_pd(reject, _mm256_cmp_pd(u, _mm256_setzero_pd(), _CMP_LT_OQ));
+    reject = _mm256_or_pd(reject, _mm256_cmp_pd(u, _mm256_set1_pd(1.0), _CMP_GT_OQ));
+
+    __m256d qx = _mm256_sub_pd(_mm256_mul_pd(ty, e1z), _mm256_mul_pd(tz, e1y));
+    __m256d qy = _mm256_sub_pd(_mm256_mul_pd(tz, e1x), _mm256_mul_pd(tx, e1z));
+    __m256d qz = _mm256_sub_pd(_mm256_mul_pd(tx, e1y), _mm256_mul_pd(ty, e1x));
+    __m256d v = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+                                            _mm256_mul_pd(dz, qz)), inv_det);
+    reject = _mm256_or_pd(reject, _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_LT_OQ));
+    reject = _mm256_or_pd(reject, _mm256_cmp_pd(_mm256_add_pd(v, u), _mm256_set1_pd(1.0), _CMP_GT_OQ));
+
+    __m256d distance = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)),
+                                                   _mm256_mul_pd(e2z, qz)), inv_det);
+    __m256d accept = _mm256_andnot_pd(reject, _mm256_cmp_pd(distance, _mm256_set1_pd(1e-8), _CMP_GT_OQ));
+
+    _mm256_storeu_pd(t, distance);
+    return _mm256_movemask_pd(accept) & ((1 << count) - 1);
+}
+
+__attribute__((target("avx2")))
+static int intersectAvx2(const TriangleSoA &soa, int first, int count,
+                         const double origin[3], const double direction[3], double t[]) {
+    int mask = intersectAvx2Half(soa, first, count < 4 ? count : 4, origin, direction, t);
+    if (count > 4) {
+        mask |= intersectAvx2Half(soa, first + 4, count - 4, origin, direction, t + 4) << 4;
+    }
+    return mask;
+}
+
+//==============================================================================
+//================================ AVX-512 kernel ==============================
+//==============================================================================
+__attribute__((target("avx512f")))
+static int intersectAvx512(const TriangleSoA &soa, int first, int count,
+                           const double origin[3], const double direction[3], double t[]) {
+    const __m512d dx = _mm512_set1_pd(direction[0]);
+    const __m512d dy = _mm512_set1_pd(direction[1]);
+    const __m512d dz = _mm512_set1_pd(direction[2]);
+
+    const __m512d e1x = _mm512_loadu_pd(&soa.e1x[first]);
+    const __m512d e1y = _mm512_loadu_pd(&soa.e1y[first]);
+    const __m512d e1z = _mm512_loadu_pd(&soa.e1z[first]);
+    const __m512d e2x = _mm512_loadu_pd(&soa.e2x[first]);
+    const __m512d e2y = _mm512_loadu_pd(&soa.e2y[first]);
+    const __m512d e2z = _mm512_loadu_pd(&soa.e2z[first]);
+
+    __m512d px = _mm512_sub_pd(_mm512_mul_pd(dy, e2z), _mm512_mul_pd(dz, e2y));
+    __m512d py = _mm512_sub_pd(_mm512_mul_pd(dz, e2x), _mm512_mul_pd(dx, e2z));
+    __m512d pz = _mm512_sub_pd(_mm512_mul_pd(dx, e2y), _mm512_mul_pd(dy, e2x));
+    __m512d det = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e1x, px), _mm512_mul_pd(e1y, py)),
+                                _mm512_mul_pd(e1z, pz));
+    __mmask8 reject = _mm512_cmp_pd_mask(det, _mm512_set1_pd(1e-8), _CMP_LT_OQ) &
+                      _mm512_cmp_pd_mask(det, _mm512_set1_pd(-1e-8), _CMP_GT_OQ);
+
+    __m512d inv_det = _mm512_div_pd(_mm512_set1_pd(1.0), det);
+    __m512d tx = _mm512_sub_pd(_mm512_set1_pd(origin[0]), _mm512_loadu_pd(&soa.v0x[first]));
+    __m512d ty = _mm512_sub_pd(_mm512_set1_pd(origin[1]), _mm512_loadu_pd(&soa.v0y[first]));
+    __m512d tz = _mm512_sub_pd(_mm512_set1_pd(origin[2]), _mm512_loadu_pd(&soa.v0z[first]));
+    __m512d u = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(tx, px), _mm512_mul_pd(ty, py)),
+                                            _mm512_mul_pd(tz, pz)), inv_det);
+    reject |= _mm512_cmp_pd_mask(u, _mm512_setzero_pd(), _CMP_LT_OQ);
+    reject |= _mm512_cmp_pd_mask(u, _mm512_set1_pd(1.0), _CMP_GT_OQ);
+
+    __m512d qx = _mm512_sub_pd(_mm512_mul_pd(ty, e1z), _mm512_mul_pd(tz, e1y));
+    __m512d qy = _mm512_sub_pd(_mm512_mul_pd(tz, e1x), _mm512_mul_pd(tx, e1z));
+    __m512d qz = _mm512_sub_pd(_mm512_mul_pd(tx, e1y), _mm512_mul_pd(ty, e1x));
+    __m512d v = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, qx), _mm512_mul_pd(dy, qy)),
+                                            _mm512_mul_pd(dz, qz)), inv_det);
+    reject |= _mm512_cmp_pd_mask(v, _mm512_setzero_pd(), _CMP_LT_OQ);
+    reject |= _mm512_cmp_pd_mask(_mm512_add_pd(v, u), _mm512_set1_pd(1.0), _CMP_GT_OQ);
+
+    __m512d distance = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e2x, qx), _mm512_mul_pd(e2y, qy)),
+                                                   _mm512_mul_pd(e2z, qz)), inv_det);
+    __mmask8 accept = _mm512_cmp_pd_mask(distance, _mm512_set1_pd(1e-8), _CMP_GT_OQ) & ~reject;
+
+    _mm512_storeu_pd(t, distance);
+    return accept & ((1 << count) - 1);
+}
+#endif
+
+//==============================================================================
+//================================ Dispatch ====================================
+//==============================================================================
+KernelType detectKernelType() {
+#ifdef TRIANGLE_KERNELS_X86
+    __builtin_cpu_init();
+#ifndef PATH_TRACING_SINGLE_PRECISION
+    if (__builtin_cpu_supports("avx512f")) {
+        return KernelType::AVX512;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2")) {
+        return KernelType::AVX2;
+    }
+#endif
+    return KernelType::Scalar;
+}
+
+TriangleKernel getTriangleKernel(KernelType type) {
+    switch (type) {
+#if defined(TRIANGLE_KERNELS_X86) && defined(PATH_TRACING_SINGLE_PRECISION)
+        case KernelType::AVX512:
+        case KernelType::AVX2:
+            return intersectAvx2;
+#elif defined(TRIANGLE_KERNELS_X86)
+        case KernelType::AVX512:
+            return intersectAvx512;
+        case KernelType::AVX2:
+            return intersectAvx2;
+#endif
+        default:
+            return intersectScalar;
+    }
+}
+
+const char *getKernelName(KernelType type) {
+    switch (type) {
+        case KernelType::AVX512:
+            return "avx512";
+        case KernelType::AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
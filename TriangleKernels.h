@@ -0,0 +1,59 @@
+#ifndef TRIANGLE_KERNELS_H
+#define TRIANGLE_KERNELS_H
+
+#include "Precision.h"
+
+#include <cstddef>
+#include <vector>
+
+//==============================================================================
+//================================ TriangleSoA =================================
+//==============================================================================
+// Structure-of-arrays copy of the triangles with precomputed edges, laid out in
+// BVH leaf order so a leaf is a contiguous run of lanes.
+struct TriangleSoA {
+public:
+    static constexpr int maxBatchSize = 8;
+
+    void clear();
+    void reserve(size_t count);
+    void push(const Vec3r &v0, const Vec3r &v1, const Vec3r &v2);
+    // Replaces triangle i, e.g. after the geometry moved
+    void set(size_t i, const Vec3r &v0, const Vec3r &v1, const Vec3r &v2);
+    // Sizes the arrays for count triangles plus the finalize() padding, to be filled directly
+    void resize(size_t count);
+    // Appends degenerate triangles so a full-width load past the last triangle stays in bounds
+    void finalize();
+    size_t size() const { return count; }
+
+public:
+    std::vector<Real> v0x, v0y, v0z;
+    std::vector<Real> e1x, e1y, e1z;
+    std::vector<Real> e2x, e2y, e2z;
+
+private:
+    size_t count = 0;
+};
+
+//==============================================================================
+//================================ Kernels =====================================
+//==============================================================================
+// Möller–Trumbore test of one ray against up to maxBatchSize consecutive triangles
+// starting at `first`. Returns the hit mask and writes distances of hit lanes to t.
+// Every kernel performs exactly the operations of Triangle::intersect in the same
+// order, so all of them report bit-identical distances.
+using TriangleKernel = int (*)(const TriangleSoA &soa, int first, int count,
+                               const Real origin[3], const Real direction[3], Real t[]);
+
+enum class KernelType {
+    Scalar,
+    AVX2,
+    AVX512
+};
+
+// Float builds never report AVX512: a leaf already fits one 256-bit register
+KernelType detectKernelType();
+TriangleKernel getTriangleKernel(KernelType type);
+const char *getKernelName(KernelType type);
+
+#endif //TRIANGLE_KERNELS_H
@@ -0,0 +1,161 @@
+#ifndef VEC_MATH_H
+#define VEC_MATH_H
+
+#include <initializer_list>
+#include <type_traits>
+
+//==============================================================================
+//================================ Vec =========================================
+//==============================================================================
+// Fixed-size vectors for points, directions and colors, standing in for the part
+// of cv::Vec the renderer uses: val and [] access, dot, cross, per-element mul and
+// arithmetic with vectors and scalars. Every operation is a constexpr loop over the
+// elements, which inlines into straight-line code and SIMD registers. The arithmetic
+// is that of cv::Vec, down to dividing by multiplying with the reciprocal and the
+// type a scalar product is computed in, so images are the same as with OpenCV.
+// Four-element vectors are aligned to their size for full-width loads; three-element
+// ones are not padded, so arrays of them keep their layout in the scene cache, the
+// distributed protocol and the image writers.
+template<typename T, int N>
+struct alignas(N == 4 ? sizeof(T) * 4 : alignof(T)) Vec {
+public:
+    constexpr Vec() : val{} {}
+    template<typename... Args, typename = std::enable_if_t<sizeof...(Args) == N && (N > 1)>>
+    constexpr Vec(Args... args) : val{T(args)...} {}
+    constexpr Vec(std::initializer_list<T> values) : val{} {
+        int i = 0;
+        for (T value : values) {
+            if (i < N) {
+                val[i++] = value;
+            }
+        }
+    }
+
+    template<typename U>
+    constexpr operator Vec<U, N>() const {
+        Vec<U, N> result;
+        for (int i = 0; i < N; i++) {
+            result.val[i] = U(val[i]);
+        }
+        return result;
+    }
+
+    constexpr T &operator[](int i) { return val[i]; }
+    constexpr const T &operator[](int i) const { return val[i]; }
+
+    constexpr T dot(const Vec &other) const {
+        T sum = 0;
+        for (int i = 0; i < N; i++) {
+            sum += val[i] * other.val[i];
+        }
+        return sum;
+    }
+    constexpr Vec cross(const Vec &other) const {
+        static_assert(N == 3, "cross product of 3-element vectors only");
+        return Vec(val[1] * other.val[2] - val[2] * other.val[1],
+                   val[2] * other.val[0] - val[0] * other.val[2],
+                   val[0] * other.val[1] - val[1] * other.val[0]);
+    }
+    // Per-element product
+    constexpr Vec mul(const Vec &other) const {
+        Vec result;
+        for (int i = 0; i < N; i++) {
+            result.val[i] = val[i] * other.val[i];
+        }
+        return result;
+    }
+
+public:
+    T val[N];
+};
+
+template<typename T, int N>
+constexpr Vec<T, N> operator+(const Vec<T, N> &a, const Vec<T, N> &b) {
+    Vec<T, N> result;
+    for (int i = 0; i < N; i++) {
+        result.val[i] = a.val[i] + b.val[i];
+    }
+    return result;
+}
+
+template<typename T, int N>
+constexpr Vec<T, N> operator-(const Vec<T, N> &a, const Vec<T, N> &b) {
+    Vec<T, N> result;
+    for (int i = 0; i < N; i++) {
+        result.val[i] = a.val[i] - b.val[i];
+    }
+    return result;
+}
+
+template<typename T, int N>
+constexpr Vec<T, N> operator-(const Vec<T, N> &a) {
+    Vec<T, N> result;
+    for (int i = 0; i < N; i++) {
+        result.val[i] = -a.val[i];
+    }
+    return result;
+}
+
+// The product is computed in the wider of the two types, a float vector times a double in double
+template<typename T, int N, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+constexpr Vec<T, N> operator*(const Vec<T, N> &a, S factor) {
+    Vec<T, N> result;
+    for (int i = 0; i < N; i++) {
+        result.val[i] = T(a.val[i] * factor);
+    }
+    return result;
+}
+
+template<typename T, int N, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+constexpr Vec<T, N> operator*(S factor, const Vec<T, N> &a) {
+    return a * factor;
+}
+
+// Multiplies by the reciprocal, taken in float for a float divisor and in double otherwise
+template<typename T, int N, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+constexpr Vec<T, N> operator/(const Vec<T, N> &a, S divisor) {
+    using R = std::conditional_t<std::is_same<S, float>::value, float, double>;
+    return a * (R(1) / R(divisor));
+}
+
+template<typename T, int N>
+constexpr Vec<T, N> &operator+=(Vec<T, N> &a, const Vec<T, N> &b) {
+    return a = a + b;
+}
+
+template<typename T, int N>
+constexpr Vec<T, N> &operator-=(Vec<T, N> &a, const Vec<T, N> &b) {
+    return a = a - b;
+}
+
+template<typename T, int N, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+constexpr Vec<T, N> &operator*=(Vec<T, N> &a, S factor) {
+    return a = a * factor;
+}
+
+template<typename T, int N, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+constexpr Vec<T, N> &operator/=(Vec<T, N> &a, S divisor) {
+    return a = a / divisor;
+}
+
+template<typename T, int N>
+constexpr bool operator==(const Vec<T, N> &a, const Vec<T, N> &b) {
+    for (int i = 0; i < N; i++) {
+        if (a.val[i] != b.val[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T, int N>
+constexpr bool operator!=(const Vec<T, N> &a, const Vec<T, N> &b) {
+    return !(a == b);
+}
+
+using Vec3d = Vec<double, 3>;
+using Vec3f = Vec<float, 3>;
+using Vec4d = Vec<double, 4>;
+using Vec4f = Vec<float, 4>;
+
+#endif //VEC_MATH_H
@@ -0,0 +1,180 @@
+#include "RenderTools.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+//==============================================================================
+//================================ Wavefront ===================================
+//==============================================================================
+// Paths advance stage by stage instead of one pixel at a time: a batch of rays is
+// intersected, the hits are sorted by material and direction octant and shaded
+// together, and the shadow and reflection rays they spawn form the next queues.
+namespace {
+
+struct PathState {
+    Ray ray;
+    Vec3r throughput;
+    Real weight = 1;
+    int pixel = 0;
+    Sampler sampler;
+};
+
+struct ShadowRecord {
+    int pixel = 0;
+    Vec3r lit;
+    Vec3r shadowed;
+    Ray ray;
+    Real distance = 0;
+    bool test = false;
+    bool blocked = false;
+};
+
+constexpr int chunkSize = 256;
+
+int getOctant(const Vec3r &direction) {
+    return (direction[0] < 0) | ((direction[1] < 0) << 1) | ((direction[2] < 0) << 2);
+}
+
+template<typename Body>
+void parallelChunks(ThreadPool &pool, size_t count, const Body &body) {
+    int chunks = (int) ((count + chunkSize - 1) / chunkSize);
+    pool.parallelFor(chunks, [&](int chunk, int) {
+        size_t end = std::min(count, (size_t) (chunk + 1) * chunkSize);
+        for (size_t k = (size_t) chunk * chunkSize; k < end; k++) {
+            body(k);
+        }
+    });
+}
+
+}
+
+void Scene::renderWavefront(const Camera &camera, int width, int height, int y0, int y1, Vec3r *radiance) {
+    long long first = (long long) y0 * width;
+    long long pixels_count = (long long) (y1 - y0) * width;
+    int lights_count = getLightsPerHit();
+    int keys_count = std::max(1, (int) materials.size()) * 8;
+
+    std::vector<PathState> paths, survivors, next_paths;
+    std::vector<int> sorted_paths;
+    std::vector<Hit> hits;
+    std::vector<ShadowRecord> shadows;
+    std::vector<char> alive;
+    std::vector<int> offsets;
+
+    // Camera rays; path.pixel indexes radiance, the sampler uses the position in the whole grid
+    paths.resize(pixels_count);
+    parallelChunks(*pool, paths.size(), [&](size_t k) {
+        long long pixel = first + (long long) k;
+        PathState &path = paths[k];
+        path.sampler = Sampler(samplerType, pixel, 0);
+        path.ray = camera.sampleRay(width, height, pixel / width, pixel % width, path.sampler, false);
+        path.throughput = Vec3r(1, 1, 1);
+        path.weight = 1;
+        path.pixel = (int) k;
+        radiance[k] = Vec3r(0, 0, 0);
+    });
+    STATS_ADD(cameraRays, pixels_count);
+
+    for (int depth = 0; depth < maxDepth && !paths.empty(); depth++) {
+        if (depth > 0) {
+            STATS_ADD(reflectionRays, (long long) paths.size());
+        }
+
+        // Intersection
+        hits.resize(paths.size());
+        parallelChunks(*pool, paths.size(), [&](size_t k) {
+            closestHit(paths[k].ray, hits[k]);
+        });
+
+        // Counting sort of the hits by material and direction octant, misses are dropped.
+        // The sort is stable, so the order inside a bucket does not depend on scheduling.
+        auto key = [&](int path) {
+            return std::max(0, getHitMaterialId(hits[path])) * 8 + getOctant(paths[path].ray.direction);
+        };
+        offsets.assign(keys_count + 1, 0);
+        for (int k = 0; k < hits.size(); k++) {
+            if (hits[k].triangle >= 0) {
+                offsets[key(k) + 1]++;
+            }
+        }
+        for (int k = 0; k < keys_count; k++) {
+            offsets[k + 1] += offsets[k];
+        }
+        sorted_paths.resize(offsets[keys_count]);
+        for (int k = 0; k < hits.size(); k++) {
+            if (hits[k].triangle >= 0) {
+                sorted_paths[offsets[key(k)]++] = k;
+            }
+        }
+
+        // Shading: every hit writes its own slots of the shadow and reflection queues
+        shadows.assign(sorted_paths.size() * lights_count, ShadowRecord());
+        next_paths.resize(sorted_paths.size());
+        alive.assign(sorted_paths.size(), 0);
+        parallelChunks(*pool, sorted_paths.size(), [&](size_t k) {
+            PathState &path = paths[sorted_paths[k]];
+            Vec3r hitRayIntersection, N;
+            Material material;
+            getHitSurface(path.ray, hits[sorted_paths[k]], hitRayIntersection, N, material);
+
+            path.weight /= M_PI;
+            for (int s = 0; s < lights_count; s++) {
+                Real scale;
+                int light = chooseLight(s, hitRayIntersection, path.sampler, scale);
+                LightSample sample;
+                sampleLight(lights[light], hitRayIntersection, N, material, path.throughput, sample);
+                ShadowRecord &shadow = shadows[k * lights_count + s];
+                shadow.pixel = path.pixel;
+                shadow.lit = (path.weight * scale) * sample.lit;
+                shadow.shadowed = (path.weight * scale) * sample.shadowed;
+                shadow.ray = sample.shadowRay;
+                shadow.distance = sample.distance;
+                shadow.test = sample.test;
+            }
+
+            if (material.giveBRDF() == 0) {
+                return;
+            }
+
+            Vec3r reflactionL = material.giveBRDF() * material.giveRGBCOlod().mul(path.throughput);
+            Real contribution = path.weight * std::max({reflactionL[0], reflactionL[1], reflactionL[2]});
+            if (contribution < rouletteThreshold) {
+                Real survival = contribution / rouletteThreshold;
+                if (path.sampler.get1D() >= survival) {
+                    return;
+                }
+                reflactionL /= survival;
+            }
+
+            next_paths[k] = path;
+            next_paths[k].ray = Ray(offsetRayOrigin(hitRayIntersection, N, 0),
+                                    get_normalized(path.ray.direction + 2 * N));
+            next_paths[k].throughput = reflactionL;
+            alive[k] = 1;
+        });
+
+        // Shadow rays
+        parallelChunks(*pool, shadows.size(), [&](size_t k) {
+            if (shadows[k].test) {
+                shadows[k].blocked = occluded(shadows[k].ray, shadows[k].distance);
+            }
+        });
+
+        // Serial accumulation: a pixel's entries appear in light order, exactly as fireRay adds them
+        for (const auto &shadow : shadows) {
+            radiance[shadow.pixel] += shadow.blocked ? shadow.shadowed : shadow.lit;
+        }
+
+        survivors.clear();
+        for (size_t k = 0; k < next_paths.size(); k++) {
+            if (alive[k]) {
+                survivors.push_back(next_paths[k]);
+            }
+        }
+        // Misses end their paths after depth surfaces, hits that spawn no reflection after depth + 1
+        STATS_DEPTH(depth, (long long) (hits.size() - sorted_paths.size()));
+        STATS_DEPTH(depth + 1, (long long) (sorted_paths.size() - survivors.size()));
+        std::swap(paths, survivors);
+    }
+    STATS_DEPTH(maxDepth, (long long) paths.size());
+}
@@ -0,0 +1,391 @@
+#include "RenderTools.h"
+#include "ObjLoader.h"
+
+// PATH_TRACING_REVISION, rewritten by every CMake build
+#if __has_include("Revision.h")
+#include "Revision.h"
+#endif
+#ifndef PATH_TRACING_REVISION
+#define PATH_TRACING_REVISION "unknown"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//==============================================================================
+//================================ Benchmarks ==================================
+//==============================================================================
+// path_tracing_bench [--data <dir>] [--json <file>] [--filter <text>] [--min-time <seconds>]
+//                    [--output <dir>]
+//
+// Micro benchmarks time the geometric kernels on fixed pseudo-random inputs, macro
+// benchmarks render the bundled scenes at fixed resolutions. Every benchmark is run
+// until it has taken --min-time seconds and at least minRuns times; the median run is
+// reported as ns/ray and Mrays/s. Macro benchmarks count camera rays, or every traced ray
+// when built with PATH_TRACING_STATS. With --json the results are also written as one JSON
+// object, to compare builds across commits. The timed renders write no image; with --output
+// one more render writes each macro benchmark's image there as bench_<name>.pfm.
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int minRuns = 3;
+constexpr int maxRuns = 1000;
+
+struct Options {
+    std::string dataPath = "../data";
+    std::string jsonPath;
+    std::string filter;
+    std::string outputPath;
+    double minTime = 0.5;
+};
+
+struct Result {
+    std::string name;
+    std::string level;
+    long long rays = 0;         // per run
+    int runs = 0;
+    double median = 0;          // seconds per run
+    double best = 0;
+};
+
+// Keeps the compiler from dropping the work of a benchmark
+volatile double sink = 0;
+
+class Runner {
+public:
+    explicit Runner(const Options &options) : options(options) {}
+
+    // Times body, which traces rays rays per call; setup runs once before, untimed
+    void run(const std::string &name, const std::string &level, long long rays,
+             const std::function<void()> &body) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            return;
+        }
+
+        body();     // warm-up: caches, lazily built structures, the thread pool
+        std::vector<double> times;
+        double total = 0;
+        while ((times.size() < minRuns || total < options.minTime) && times.size() < maxRuns) {
+            Clock::time_point start = Clock::now();
+            body();
+            double time = std::chrono::duration<double>(Clock::now() - start).count();
+            times.push_back(time);
+            total += time;
+        }
+        std::sort(times.begin(), times.end());
+
+        Result result;
+        result.name = name;
+        result.level = level;
+        result.rays = rays;
+        result.runs = (int) times.size();
+        result.median = times[times.size() / 2];
+        result.best = times.front();
+        results.push_back(result);
+
+        std::cout << "  " << name;
+        for (size_t i = name.size(); i < 30; i++) {
+            std::cout << ' ';
+        }
+        std::cout << getNsPerRay(result) << " ns/ray  " << getMraysPerSecond(result) << " Mrays/s  ("
+                  << result.runs << " runs)" << std::endl;
+    }
+
+    static double getNsPerRay(const Result &result) {
+        return result.median * 1e9 / result.rays;
+    }
+
+    static double getMraysPerSecond(const Result &result) {
+        return result.rays / result.median * 1e-6;
+    }
+
+    int writeJson() const {
+        std::ofstream file(options.jsonPath);
+        if (!file) {
+            return 1;
+        }
+        file << "{\n";
+        file << "  \"revision\": \"" << PATH_TRACING_REVISION << "\",\n";
+#ifdef PATH_TRACING_SINGLE_PRECISION
+        file << "  \"precision\": \"float\",\n";
+#else
+        file << "  \"precision\": \"double\",\n";
+#endif
+        file << "  \"kernel\": \"" << getKernelName(detectKernelType()) << "\",\n";
+#ifdef PATH_TRACING_STATS
+        file << "  \"stats\": true,\n";
+#else
+        file << "  \"stats\": false,\n";
+#endif
+        file << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &result = results[i];
+            file << "    {\"name\": \"" << result.name << "\", \"level\": \"" << result.level
+                 << "\", \"rays\": " << result.rays << ", \"runs\": " << result.runs
+                 << ", \"median_s\": " << result.median << ", \"best_s\": " << result.best
+                 << ", \"ns_per_ray\": " << getNsPerRay(result)
+                 << ", \"mrays_per_s\": " << getMraysPerSecond(result) << "}"
+                 << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        file << "  ]\n}\n";
+        return file.good() ? 0 : 1;
+    }
+
+private:
+    const Options &options;
+    std::vector<Result> results;
+};
+
+// Stream buffer that drops everything, to silence render() while it is timed
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+};
+
+Vec3r randomDirection(std::minstd_rand &random) {
+    std::normal_distribution<Real> normal(0, 1);
+    Vec3r direction;
+    do {
+        direction = Vec3r(normal(random), normal(random), normal(random));
+    } while (get_length(direction) == 0);
+    return get_normalized(direction);
+}
+
+void runMicro(Runner &runner, const Options &options) {
+    constexpr int count = 1 << 16;
+    std::minstd_rand random(1);
+    std::uniform_real_distribution<Real> uniform(-1, 1);
+
+    // Rays from a box around the triangle towards random points on it, so about half of them hit
+    Triangle triangle(Vec3r(-1, -1, 0), Vec3r(1, -1, 0), Vec3r(0, 1, 0));
+    std::vector<Ray> triangle_rays(count);
+    for (auto &ray : triangle_rays) {
+        Vec3r origin(2 * uniform(random), 2 * uniform(random), 1 + std::abs(uniform(random)));
+        Vec3r target(1.5 * uniform(random), 1.5 * uniform(random), 0);
+        ray = Ray(origin, get_normalized(target - origin));
+    }
+    runner.run("triangle_intersect", "micro", count, [&]() {
+        Real sum = 0;
+        for (const auto &ray : triangle_rays) {
+            Real t;
+            if (triangle.intersect(ray, t)) {
+                sum += t;
+            }
+        }
+        sink = sink + sum;
+    });
+
+    std::vector<Vec3r> vectors(count);
+    for (auto &vector : vectors) {
+        vector = Vec3r(uniform(random), uniform(random), uniform(random)) * 100;
+    }
+    runner.run("get_normalized", "micro", count, [&]() {
+        Real sum = 0;
+        for (const auto &vector : vectors) {
+            sum += get_normalized(vector)[0];
+        }
+        sink = sink + sum;
+    });
+
+    // Scene intersection: the teapot mesh seen by a 256x256 camera, and rays from random
+    // points in its bounds in random directions
+    ObjMesh mesh;
+    if (int exit_code = loadObj(options.dataPath + "/teapot.txt", mesh); exit_code != 0) {
+        std::cout << "  teapot: failed to load " << options.dataPath << "/teapot.txt: " << exit_code << std::endl;
+        return;
+    }
+    BVH bvh;
+    bvh.build(mesh.vertices, mesh.indices);
+    AABB bounds = bvh.getBounds();
+    Vec3r extent = bounds.max - bounds.min;
+    Real radius = get_length(extent) / 2;
+
+    constexpr int side = 256;
+    Camera camera(side, side, M_PI / 3, bounds.getCentroid() + Vec3r(0, 0, 2 * radius));
+    std::vector<Ray> camera_rays((size_t) side * side);
+    for (int i = 0; i < side; i++) {
+        for (int j = 0; j < side; j++) {
+            camera_rays[j + i * side] = camera.getRay(side, side, i, j);
+        }
+    }
+    std::vector<Ray> random_rays(count);
+    for (auto &ray : random_rays) {
+        Vec3r origin;
+        for (int i = 0; i < 3; i++) {
+            origin[i] = bounds.min[i] + extent[i] * (uniform(random) + 1) / 2;
+        }
+        ray = Ray(origin, randomDirection(random));
+    }
+
+    auto intersect_all = [&](const std::vector<Ray> &rays) {
+        Real sum = 0;
+        for (const auto &ray : rays) {
+            Real t;
+            int triangle_index;
+            if (bvh.intersect(ray, t, triangle_index)) {
+                sum += t;
+            }
+        }
+        sink = sink + sum;
+    };
+    runner.run("bvh_intersect_camera", "micro", (long long) camera_rays.size(), [&]() {
+        intersect_all(camera_rays);
+    });
+    runner.run("bvh_intersect_random", "micro", (long long) random_rays.size(), [&]() {
+        intersect_all(random_rays);
+    });
+
+    // The camera rays again, in the 8x8 packets of the tile renderer
+    runner.run("bvh_intersect_packet", "micro", (long long) camera_rays.size(), [&]() {
+        Ray rays[RayPacket::maxSize];
+        Real t[RayPacket::maxSize];
+        int triangle_index[RayPacket::maxSize];
+        RayPacket packet;
+        Real sum = 0;
+        for (int y = 0; y < side; y += 8) {
+            for (int x = 0; x < side; x += 8) {
+                for (int k = 0; k < RayPacket::maxSize; k++) {
+                    rays[k] = camera_rays[(x + k % 8) + (y + k / 8) * side];
+                    t[k] = std::numeric_limits<Real>::max();
+                    triangle_index[k] = -1;
+                }
+                if (packet.set(rays, RayPacket::maxSize)) {
+                    bvh.intersect(packet, packet.getFullMask(), t, triangle_index);
+                } else {
+                    for (int k = 0; k < RayPacket::maxSize; k++) {
+                        bvh.intersect(rays[k], t[k], triangle_index[k]);
+                    }
+                }
+                for (int k = 0; k < RayPacket::maxSize; k++) {
+                    sum += triangle_index[k] >= 0 ? t[k] : 0;
+                }
+            }
+        }
+        sink = sink + sum;
+    });
+}
+
+void renderScene(Runner &runner, const Options &options, const std::string &name, Scene &scene, int width, int height) {
+    Camera camera(width, height, M_PI / 3.f, Vec3r(250, 275, 500));
+    camera.setOutputPath("");
+    scene.setNewCamera(camera);
+    scene.setLightInShadows(true);
+
+    NullBuffer null_buffer;
+    auto render = [&]() {
+        std::streambuf *output = std::cout.rdbuf(&null_buffer);
+        scene.render();
+        std::cout.rdbuf(output);
+    };
+
+    long long rays = (long long) width * height;
+#ifdef PATH_TRACING_STATS
+    // One more render, counting the shadow and reflection rays as well
+    resetStats();
+    render();
+    RenderStats stats = collectStats();
+    rays = stats.cameraRays + stats.shadowRays + stats.reflectionRays;
+#endif
+    runner.run(name, "macro", rays, render);
+
+    if (!options.outputPath.empty()) {
+        camera.setOutputPath(options.outputPath + "/bench_" + name + ".pfm");
+        scene.setCamera(0, camera);
+        render();
+    }
+}
+
+void runMacro(Runner &runner, const Options &options) {
+    if (options.filter.empty() || std::string("cornell_box").find(options.filter) != std::string::npos) {
+        Scene scene;
+        if (int exit_code = scene.loadCornellBox(options.dataPath + "/cornel_box0.shp"); exit_code != 0) {
+            std::cout << "  cornell_box: failed to load scene description: " << exit_code << std::endl;
+        } else {
+            renderScene(runner, options, "cornell_box", scene, 256, 256);
+        }
+    }
+
+    // The same render in spectral mode, at about the cost per path of the RGB one
+    if (options.filter.empty() || std::string("cornell_box_spectral").find(options.filter) != std::string::npos) {
+        Scene scene;
+        if (int exit_code = scene.loadCornellBox(options.dataPath + "/cornel_box0.shp"); exit_code != 0) {
+            std::cout << "  cornell_box_spectral: failed to load scene description: " << exit_code << std::endl;
+        } else {
+            scene.setSpectral(true);
+            renderScene(runner, options, "cornell_box_spectral", scene, 256, 256);
+        }
+    }
+
+    if (options.filter.empty() || std::string("teapot").find(options.filter) != std::string::npos) {
+        Scene scene;
+        scene.loadDefaultScene();
+        if (int exit_code = scene.loadTeapot(options.dataPath + "/teapot.txt"); exit_code != 0) {
+            std::cout << "  teapot: failed to load teapot: " << exit_code << std::endl;
+        } else {
+            renderScene(runner, options, "teapot", scene, 256, 256);
+        }
+    }
+
+    if (options.filter.empty() || std::string("main_scene").find(options.filter) != std::string::npos) {
+        Scene scene;
+        scene.loadDefaultScene();
+        renderScene(runner, options, "main_scene", scene, 512, 512);
+    }
+}
+
+int parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (i + 1 >= argc) {
+            return 1;
+        }
+        if (argument == "--data") {
+            options.dataPath = argv[++i];
+        } else if (argument == "--json") {
+            options.jsonPath = argv[++i];
+        } else if (argument == "--filter") {
+            options.filter = argv[++i];
+        } else if (argument == "--output") {
+            options.outputPath = argv[++i];
+        } else if (argument == "--min-time") {
+            std::istringstream stream(argv[++i]);
+            if (!(stream >> options.minTime)) {
+                return 1;
+            }
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (parseOptions(argc, argv, options) != 0) {
+        std::cout << "Usage: path_tracing_bench [--data <dir>] [--json <file>] [--filter <text>] "
+                     "[--min-time <seconds>] [--output <dir>]" << std::endl;
+        return 1;
+    }
+
+    Runner runner(options);
+    std::cout << "micro" << std::endl;
+    runMicro(runner, options);
+    std::cout << "macro" << std::endl;
+    runMacro(runner, options);
+
+    if (!options.jsonPath.empty() && runner.writeJson() != 0) {
+        std::cout << "Bench: failed to write " << options.jsonPath << std::endl;
+        return 1;
+    }
+    return 0;
+}